@@ -0,0 +1,445 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Batched, Parallel Queries on an R-tree
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags boost parallel modules
+ * @summary Answers nearest neighbour, window, distance and containment
+ *   queries for whole matrices of points or boxes in one call, in parallel,
+ *   and returns the results in compressed (offsets, ids, distances) form.
+ *
+ * The article on [a persistent, bulk-loaded
+ * R-tree](https://gallery.rcpp.org/articles/persistent-rtree-with-bulk-loading)
+ * keeps a Boost.Geometry R-tree alive between calls, so a query costs
+ * O(log n) rather than a rebuild. But each query is still one call from R:
+ * finding the nearest boxes for a million points means a million trips
+ * through the module machinery, each of which allocates an `IntegerVector`
+ * for a handful of ids, and all of them run on a single core.
+ *
+ * Here we answer queries in batches instead. A matrix of query points (or
+ * boxes) goes in, and all the answers come back in one call, computed in
+ * parallel with RcppParallel. That is safe because queries do not modify
+ * the tree: Boost's `rtree` allows any number of concurrent `query()` calls
+ * as long as nobody inserts or removes at the same time.
+ *
+ * The variable number of answers per query is returned the way compressed
+ * sparse matrices store their columns: `ids` and `distances` hold the
+ * answers to all the queries, one after the other, and the answers to query
+ * `q` (counting from one) are at positions `offsets[q] + 1` to
+ * `offsets[q + 1]`. That layout needs three allocations for the whole batch,
+ * not one per query.
+ */
+
+// [[Rcpp::depends(BH, RcppParallel)]]
+// [[Rcpp::plugins(cpp14)]]
+#include <Rcpp.h>
+#include <RcppParallel.h>
+#include <boost/geometry.hpp>
+#include <boost/geometry/geometries/point.hpp>
+#include <boost/geometry/geometries/box.hpp>
+#include <boost/geometry/index/rtree.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+using namespace Rcpp;
+using namespace RcppParallel;
+
+namespace bg = boost::geometry;
+namespace bgi = boost::geometry::index;
+typedef bg::model::point<double, 2, bg::cs::cartesian> point_t;
+typedef bg::model::box<point_t> box;
+typedef std::pair<box, unsigned int> value_t;
+typedef bgi::rtree<value_t, bgi::rstar<16> > tree_t;
+
+/**
+ * ### Collecting Answers
+ *
+ * The queries are split into blocks of `grain` consecutive rows, and each
+ * block appends its answers to its own buffers, so no two threads ever
+ * write to the same memory. `count[q]` records how many answers query `q`
+ * produced. The buffers also hold some scratch space, which a block reuses
+ * for all of its queries.
+ */
+
+struct Hits {
+    std::vector<int> ids;
+    std::vector<double> dist;
+    std::vector<value_t> found;                         // scratch
+    std::vector<std::pair<double, int> > ranked;        // scratch
+
+    // appends the scratch answers in order of increasing distance
+    void append_ranked() {
+        std::sort(ranked.begin(), ranked.end());
+        for (std::size_t k = 0; k < ranked.size(); k++) {
+            dist.push_back(ranked[k].first);
+            ids.push_back(ranked[k].second);
+        }
+    }
+};
+
+/**
+ * Window queries do not need the values themselves, only their ids. Rather
+ * than collecting the values in a vector and copying the ids out, `query()`
+ * can write through a small output iterator which appends each id directly.
+ */
+
+struct IdAppender {
+    std::vector<int>* ids;
+
+    IdAppender& operator*() { return *this; }
+    IdAppender& operator++() { return *this; }
+    IdAppender& operator++(int) { return *this; }
+    IdAppender& operator=(const value_t& v) {
+        ids->push_back(v.second);
+        return *this;
+    }
+};
+
+/**
+ * ### The Four Queries
+ *
+ * Each kind of query is a small functor which answers query `q` into a
+ * block's buffers. Rows with missing coordinates have no answers.
+ *
+ * - `Knn` finds the `k` boxes nearest to a point. Boost returns them in no
+ *   particular order, so we rank them by distance.
+ * - `WithinDistance` finds all boxes within distance `r` of a point. The
+ *   R-tree is searched with the square of side `2r` around the point, and
+ *   the candidates in its corners are then discarded by their exact
+ *   distance. The answers are also ranked by distance.
+ * - `Intersects` finds all boxes which intersect a query box.
+ * - `Contains` finds all boxes which contain a point, including on their
+ *   boundary, which Boost calls `covers`.
+ *
+ * The first two report the distance from the point to each box (zero if
+ * the point is inside); for the other two it is zero by definition, so they
+ * leave it out.
+ */
+
+struct Knn {
+    static const bool has_distance = true;
+    const tree_t& tree;
+    const RMatrix<double> points;
+    const unsigned int k;
+
+    Knn(const tree_t& tree, NumericMatrix points, unsigned int k)
+        : tree(tree), points(points), k(k) {}
+
+    void operator()(std::size_t q, Hits& hits) const {
+        const point_t p(points(q, 0), points(q, 1));
+        if (std::isnan(points(q, 0)) || std::isnan(points(q, 1))) return;
+        hits.found.clear();
+        tree.query(bgi::nearest(p, k), std::back_inserter(hits.found));
+        hits.ranked.clear();
+        for (std::size_t m = 0; m < hits.found.size(); m++)
+            hits.ranked.push_back(std::make_pair(bg::distance(p, hits.found[m].first),
+                                                 (int) hits.found[m].second));
+        hits.append_ranked();
+    }
+};
+
+struct WithinDistance {
+    static const bool has_distance = true;
+    const tree_t& tree;
+    const RMatrix<double> points;
+    const double r;
+
+    WithinDistance(const tree_t& tree, NumericMatrix points, double r)
+        : tree(tree), points(points), r(r) {}
+
+    void operator()(std::size_t q, Hits& hits) const {
+        const double x = points(q, 0), y = points(q, 1);
+        if (std::isnan(x) || std::isnan(y)) return;
+        const point_t p(x, y);
+        hits.found.clear();
+        tree.query(bgi::intersects(box(point_t(x - r, y - r), point_t(x + r, y + r))),
+                   std::back_inserter(hits.found));
+        hits.ranked.clear();
+        for (std::size_t m = 0; m < hits.found.size(); m++) {
+            const double d = bg::distance(p, hits.found[m].first);
+            if (d <= r) hits.ranked.push_back(std::make_pair(d, (int) hits.found[m].second));
+        }
+        hits.append_ranked();
+    }
+};
+
+struct Intersects {
+    static const bool has_distance = false;
+    const tree_t& tree;
+    const RMatrix<double> boxes;
+
+    Intersects(const tree_t& tree, NumericMatrix boxes) : tree(tree), boxes(boxes) {}
+
+    void operator()(std::size_t q, Hits& hits) const {
+        for (int c = 0; c < 4; c++) if (std::isnan(boxes(q, c))) return;
+        const box b(point_t(boxes(q, 0), boxes(q, 1)), point_t(boxes(q, 2), boxes(q, 3)));
+        IdAppender out = { &hits.ids };
+        tree.query(bgi::intersects(b), out);
+    }
+};
+
+struct Contains {
+    static const bool has_distance = false;
+    const tree_t& tree;
+    const RMatrix<double> points;
+
+    Contains(const tree_t& tree, NumericMatrix points) : tree(tree), points(points) {}
+
+    void operator()(std::size_t q, Hits& hits) const {
+        if (std::isnan(points(q, 0)) || std::isnan(points(q, 1))) return;
+        IdAppender out = { &hits.ids };
+        tree.query(bgi::covers(point_t(points(q, 0), points(q, 1))), out);
+    }
+};
+
+/**
+ * ### Running a Batch
+ *
+ * The first parallel pass answers the queries block by block. The offsets
+ * are then a prefix sum over the per-query counts, which is cheap enough to
+ * do serially, and a second parallel pass copies each block's buffers to
+ * its place in the result. Each buffer is released as soon as it has been
+ * copied, which keeps the peak memory near a single copy of the answers.
+ */
+
+template <class Query>
+struct AnswerBlocks : public Worker {
+    const Query& query;
+    const std::size_t nq, grain;
+    std::vector<Hits>& hits;
+    std::vector<int>& count;
+
+    AnswerBlocks(const Query& query, std::size_t nq, std::size_t grain,
+                 std::vector<Hits>& hits, std::vector<int>& count)
+        : query(query), nq(nq), grain(grain), hits(hits), count(count) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t b = begin; b < end; b++) {
+            Hits& h = hits[b];
+            for (std::size_t q = b * grain; q < std::min(nq, (b + 1) * grain); q++) {
+                const std::size_t before = h.ids.size();
+                query(q, h);
+                count[q] = h.ids.size() - before;
+            }
+            std::vector<value_t>().swap(h.found);
+            std::vector<std::pair<double, int> >().swap(h.ranked);
+        }
+    }
+};
+
+struct CopyBlocks : public Worker {
+    std::vector<Hits>& hits;
+    const RVector<int> offsets;
+    const std::size_t grain;
+    RVector<int> ids;
+    RVector<double> dist;
+    const bool has_distance;
+
+    CopyBlocks(std::vector<Hits>& hits, IntegerVector offsets, std::size_t grain,
+               IntegerVector ids, NumericVector dist, bool has_distance)
+        : hits(hits), offsets(offsets), grain(grain), ids(ids), dist(dist),
+          has_distance(has_distance) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t b = begin; b < end; b++) {
+            const std::size_t pos = offsets[b * grain];
+            std::copy(hits[b].ids.begin(), hits[b].ids.end(), ids.begin() + pos);
+            if (has_distance)
+                std::copy(hits[b].dist.begin(), hits[b].dist.end(), dist.begin() + pos);
+            std::vector<int>().swap(hits[b].ids);
+            std::vector<double>().swap(hits[b].dist);
+        }
+    }
+};
+
+template <class Query>
+List run_batch(const Query& query, std::size_t nq, std::size_t grain) {
+    const std::size_t nblocks = (nq + grain - 1) / grain;
+    std::vector<Hits> hits(nblocks);
+    std::vector<int> count(nq);
+    AnswerBlocks<Query> answer(query, nq, grain, hits, count);
+    parallelFor(0, nblocks, answer, 1);
+
+    IntegerVector offsets(nq + 1);
+    std::size_t total = 0;
+    for (std::size_t q = 0; q < nq; q++) {
+        offsets[q] = total;
+        total += count[q];
+        if (total > (std::size_t) std::numeric_limits<int>::max())
+            stop("too many answers for one batch; split the queries");
+    }
+    offsets[nq] = total;
+
+    IntegerVector ids(total);
+    NumericVector dist(Query::has_distance ? total : 0);
+    CopyBlocks copy(hits, offsets, grain, ids, dist, Query::has_distance);
+    parallelFor(0, nblocks, copy, 1);
+
+    if (Query::has_distance)
+        return List::create(_["offsets"] = offsets, _["ids"] = ids, _["distances"] = dist);
+    return List::create(_["offsets"] = offsets, _["ids"] = ids);
+}
+
+/**
+ * Since `stop()` must not be called from a worker thread, the query
+ * matrices are checked on the main thread before each batch starts.
+ */
+
+void check_columns(const NumericMatrix& m, int ncol, const char* what) {
+    if (m.ncol() != ncol) stop("%s must be a matrix with %d columns", what, ncol);
+}
+
+/**
+ * ### The Index
+ *
+ * The index is built by bulk loading from the same data frame of boxes as
+ * before, and exposes the batched queries as module methods. The block
+ * size is a property, so that it can be tuned from R; its setter rejects
+ * sizes below one, which would otherwise wrap around when converted to
+ * `std::size_t` and leave every query without blocks.
+ */
+
+class RTreeIndex {
+public:
+    explicit RTreeIndex(DataFrame df) : grain(256) {
+        IntegerVector id = df["id"];
+        NumericVector bl_x = df["bl_x"], bl_y = df["bl_y"], ur_x = df["ur_x"], ur_y = df["ur_y"];
+        std::vector<value_t> values;
+        values.reserve(df.nrows());
+        for (int i = 0; i < df.nrows(); i++) {
+            if (id[i] < 0) stop("ids must be non-negative");
+            values.push_back(std::make_pair(box(point_t(bl_x[i], bl_y[i]), point_t(ur_x[i], ur_y[i])),
+                                            static_cast<unsigned int>(id[i])));
+        }
+        tree_t packed(values.begin(), values.end());
+        tree.swap(packed);
+    }
+
+    int size() const { return tree.size(); }
+
+    int get_grain() const { return grain; }
+    void set_grain(int g) {
+        if (g < 1) stop("grain must be at least 1");
+        grain = g;
+    }
+
+    List knn(NumericMatrix points, int k) const {
+        check_columns(points, 2, "points");
+        if (k < 1) stop("k must be positive");
+        return run_batch(Knn(tree, points, k), points.nrow(), grain);
+    }
+
+    List within_distance(NumericMatrix points, double r) const {
+        check_columns(points, 2, "points");
+        if (!(r >= 0)) stop("r must be non-negative");
+        return run_batch(WithinDistance(tree, points, r), points.nrow(), grain);
+    }
+
+    List intersects(NumericMatrix boxes) const {
+        check_columns(boxes, 4, "boxes");
+        return run_batch(Intersects(tree, boxes), boxes.nrow(), grain);
+    }
+
+    List contains(NumericMatrix points) const {
+        check_columns(points, 2, "points");
+        return run_batch(Contains(tree, points), points.nrow(), grain);
+    }
+
+private:
+    int grain;
+    tree_t tree;
+};
+
+RCPP_MODULE(rtree_batch_module) {
+    class_<RTreeIndex>("RTreeIndex")
+    .constructor<DataFrame>()
+    .property("grain", &RTreeIndex::get_grain, &RTreeIndex::set_grain)
+    .property("size", &RTreeIndex::size)
+    .method("knn", &RTreeIndex::knn)
+    .method("within_distance", &RTreeIndex::within_distance)
+    .method("intersects", &RTreeIndex::intersects)
+    .method("contains", &RTreeIndex::contains)
+    ;
+}
+
+/**
+ * ### Using the Index
+ *
+ * Query points are the rows of a two-column matrix, query boxes the rows
+ * of a four-column matrix `(bl_x, bl_y, ur_x, ur_y)`. With the three boxes
+ * of the original article:
+ */
+
+/*** R
+boxes <- data.frame(id=0:2, bl_x=c(0, 2, 4), bl_y=c(0, 2, 4),
+                    ur_x=c(1, 3, 5), ur_y=c(1, 3, 5))
+idx <- new(RTreeIndex, boxes)
+pts <- rbind(c(0, 0), c(2.5, 2.5), c(NA, 1))
+res <- idx$knn(pts, 2)
+res
+*/
+
+/**
+ * The answers for each query are easily recovered when they are needed as
+ * a list, and the same layout feeds the other queries:
+ */
+
+/*** R
+as_list <- function(res) {
+    n <- length(res$offsets) - 1
+    split(res$ids, factor(rep(seq_len(n), diff(res$offsets)), levels=seq_len(n)))
+}
+as_list(res)
+as_list(idx$within_distance(pts, 1.5))
+as_list(idx$intersects(rbind(c(0.5, 0.5, 2.5, 2.5), c(10, 10, 11, 11))))
+as_list(idx$contains(rbind(c(1, 1), c(4.5, 4.5), c(1.5, 1.5))))
+*/
+
+/**
+ * ### Timing
+ *
+ * A hundred thousand random boxes and ten thousand query points. As a
+ * baseline we send the same queries one row at a time, as a loop over the
+ * single point `knn()` of the persistent R-tree article would; the first
+ * hundred are checked to give the same answers.
+ */
+
+/*** R
+set.seed(42)
+n <- 1e5
+x <- runif(n, 0, 1000); y <- runif(n, 0, 1000)
+big <- new(RTreeIndex, data.frame(id=seq_len(n) - 1L, bl_x=x, bl_y=y,
+                                  ur_x=x + runif(n), ur_y=y + runif(n)))
+queries <- matrix(runif(2e4, 0, 1000), ncol=2)
+
+batched <- big$knn(queries, 5)
+single <- lapply(1:100, function(i) big$knn(queries[i, , drop=FALSE], 5)$ids)
+stopifnot(identical(as_list(batched)[1:100], setNames(single, 1:100)))
+
+library(rbenchmark)
+benchmark(batched = big$knn(queries, 5),
+          one_by_one = for (i in 1:nrow(queries)) big$knn(queries[i, , drop=FALSE], 5),
+          order = "relative", replications = 5)[,1:4]
+benchmark(knn = big$knn(queries, 5),
+          within = big$within_distance(queries, 2),
+          intersects = big$intersects(cbind(queries, queries + 2)),
+          contains = big$contains(queries),
+          order = "relative", replications = 5)[,1:4]
+*/
+
+/**
+ * The batched call avoids the per-call overhead of the module, which for
+ * queries this cheap dominates the cost, and spreads the remaining work
+ * over all cores. Both matter: the tree search itself takes only a few
+ * microseconds per point.
+ *
+ * The results are in the same layout as the columns of a `dgCMatrix`, with
+ * `offsets` playing the part of the `p` slot. When the box ids are `0` to
+ * `n - 1`, as here, the answers of a window query can be handed to
+ * `Matrix::sparseMatrix(i = ids + 1, p = offsets)` as an incidence matrix
+ * of boxes by queries, without any further work on the C++ side.
+ */
@@ -0,0 +1,414 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Dynamic Dispatch over Sparse Storage Formats
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags sparse armadillo matrix
+ * @summary Extends the dynamic dispatch example to the main sparse matrix
+ *   classes of the Matrix package, running a native kernel for each storage
+ *   format instead of converting to a common one.
+ *
+ * The article on [dynamic dispatch for sparse
+ * matrices](https://gallery.rcpp.org/articles/dynamic-dispatch-for-sparse-matrices)
+ * inspects the class of its argument at run time and calls a different
+ * multiplication routine for a dense matrix, a `dgCMatrix` and an
+ * `indMatrix`. The Matrix package has many more classes, though, and
+ * handling them by first converting to `dgCMatrix` (which is what
+ * `as<arma::sp_mat>()` does internally for the others) costs a full copy
+ * and, for a symmetric matrix stored as one triangle, doubles its size.
+ *
+ * Here we generalise the idea into a small dispatch layer. Each supported
+ * class is described by a lightweight *view* of its slots, which records the
+ * storage format:
+ *
+ * - compressed sparse column (`dgCMatrix`, `lgCMatrix`, `ngCMatrix`),
+ * - compressed sparse row (`dgRMatrix`),
+ * - triplet (`dgTMatrix`),
+ * - compressed sparse column holding one triangle of a symmetric matrix
+ *   (`dsCMatrix`),
+ * - row index (`indMatrix`) and dense (base R `matrix`).
+ *
+ * An *operation* is a function object with one overload per format. The
+ * dispatcher builds the right view and calls the operation on it, so adding
+ * an operation means writing its kernels, and adding a class means writing
+ * its view, without touching anything else.
+ */
+
+// [[Rcpp::depends(RcppArmadillo)]]
+#include <RcppArmadillo.h>
+using namespace Rcpp;
+
+#include <numeric>
+
+/**
+ * ### Values
+ *
+ * Real, logical and pattern matrices differ only in how the value of the
+ * `k`-th stored element is obtained. A value policy turns that into a
+ * `double`: logical `NA` becomes `NA_REAL`, and a pattern matrix, which has
+ * no `x` slot at all, has the value one at every stored position. The
+ * kernels are templates over the policy, so the pattern case costs no memory
+ * access at all.
+ */
+
+struct RealValues {
+    const double* x;
+    explicit RealValues(const S4& m) : x(REAL(m.slot("x"))) {}
+    double operator[](R_xlen_t k) const { return x[k]; }
+};
+
+struct LogicalValues {
+    const int* x;
+    explicit LogicalValues(const S4& m) : x(LOGICAL(m.slot("x"))) {}
+    double operator[](R_xlen_t k) const { return x[k] == NA_LOGICAL ? NA_REAL : x[k]; }
+};
+
+struct PatternValues {
+    explicit PatternValues(const S4&) {}
+    double operator[](R_xlen_t) const { return 1.0; }
+};
+
+/**
+ * ### Views
+ *
+ * A view holds the dimensions and plain pointers into the slots. The
+ * pointers stay valid for as long as the matrix itself, which the dispatcher
+ * keeps alive until the operation has returned.
+ */
+
+struct Dims {
+    int nrow, ncol;
+    explicit Dims(const S4& m) {
+        IntegerVector d = m.slot("Dim");
+        nrow = d[0];
+        ncol = d[1];
+    }
+};
+
+template <class V>
+struct CscView : Dims {
+    const int *p, *i;
+    V x;
+    explicit CscView(const S4& m)
+        : Dims(m), p(INTEGER(m.slot("p"))), i(INTEGER(m.slot("i"))), x(m) {}
+};
+
+// one triangle (either one) of a symmetric matrix, in CSC form
+template <class V>
+struct SymmetricCscView : CscView<V> {
+    explicit SymmetricCscView(const S4& m) : CscView<V>(m) {}
+};
+
+template <class V>
+struct CsrView : Dims {
+    const int *p, *j;
+    V x;
+    explicit CsrView(const S4& m)
+        : Dims(m), p(INTEGER(m.slot("p"))), j(INTEGER(m.slot("j"))), x(m) {}
+};
+
+template <class V>
+struct TripletView : Dims {
+    const int *i, *j;
+    R_xlen_t nnz;
+    V x;
+    explicit TripletView(const S4& m)
+        : Dims(m), i(INTEGER(m.slot("i"))), j(INTEGER(m.slot("j"))),
+          nnz(Rf_xlength(m.slot("i"))), x(m) {}
+};
+
+struct IndexView : Dims {
+    const int* perm;        // one-based column index of the single 1 per row
+    explicit IndexView(const S4& m) : Dims(m), perm(INTEGER(m.slot("perm"))) {}
+};
+
+struct DenseView {
+    int nrow, ncol;
+    const double* x;
+    explicit DenseView(const NumericMatrix& m) : nrow(m.nrow()), ncol(m.ncol()), x(m.begin()) {}
+};
+
+/**
+ * ### The Dispatcher
+ *
+ * The dispatcher tests the class attribute with `Rf_inherits()`, as the
+ * original article does, and hands the matching view to the operation. Any
+ * other class is an error rather than a silent conversion, so that a missing
+ * kernel shows up as such instead of as a slow path.
+ */
+
+template <class Op>
+typename Op::result_type dispatch(SEXP xr, Op& op) {
+    if (!Rf_isS4(xr)) {
+        NumericMatrix x(xr);
+        return op(DenseView(x));
+    }
+    S4 x(xr);
+    if (Rf_inherits(xr, "dgCMatrix")) return op(CscView<RealValues>(x));
+    if (Rf_inherits(xr, "lgCMatrix")) return op(CscView<LogicalValues>(x));
+    if (Rf_inherits(xr, "ngCMatrix")) return op(CscView<PatternValues>(x));
+    if (Rf_inherits(xr, "dsCMatrix")) return op(SymmetricCscView<RealValues>(x));
+    if (Rf_inherits(xr, "dgRMatrix")) return op(CsrView<RealValues>(x));
+    if (Rf_inherits(xr, "dgTMatrix")) return op(TripletView<RealValues>(x));
+    if (Rf_inherits(xr, "indMatrix")) return op(IndexView(x));
+    CharacterVector cls = x.attr("class");
+    stop("unsupported class '%s'", (const char*) cls[0]);
+}
+
+/**
+ * ### Multiplication by a Dense Matrix
+ *
+ * The first operation is the product `X %*% Y` of the original article. Each
+ * kernel walks the storage in its natural order and accumulates into the
+ * column-major result, one column of `Y` at a time:
+ *
+ * - CSC: column `j` of `X` is added to the result with weight `Y[j, c]`;
+ * - CSR: every result entry is a dot product of a row of `X` with `Y[, c]`;
+ * - triplet: each stored element contributes on its own, which also sums
+ *   duplicated entries, exactly as the Matrix package defines them;
+ * - symmetric: each stored off-diagonal element stands for itself *and* its
+ *   mirror image, so it contributes twice. This works whichever triangle is
+ *   stored, and never materialises the other one.
+ */
+
+struct Multiply {
+    typedef NumericMatrix result_type;
+    const NumericMatrix& y;
+    explicit Multiply(const NumericMatrix& y) : y(y) {}
+
+    void check(int ncol) const {
+        if (ncol != y.nrow()) stop("non-conformable arguments");
+    }
+
+    template <class V>
+    NumericMatrix operator()(const CscView<V>& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        for (int c = 0; c < y.ncol(); c++) {
+            double* out = &res(0, c);
+            for (int j = 0; j < x.ncol; j++) {
+                const double w = y(j, c);
+                if (w == 0.0) continue;
+                for (int k = x.p[j]; k < x.p[j + 1]; k++) out[x.i[k]] += x.x[k] * w;
+            }
+        }
+        return res;
+    }
+
+    template <class V>
+    NumericMatrix operator()(const SymmetricCscView<V>& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        for (int c = 0; c < y.ncol(); c++) {
+            double* out = &res(0, c);
+            const double* in = &y(0, c);
+            for (int j = 0; j < x.ncol; j++) {
+                for (int k = x.p[j]; k < x.p[j + 1]; k++) {
+                    const int i = x.i[k];
+                    out[i] += x.x[k] * in[j];
+                    if (i != j) out[j] += x.x[k] * in[i];
+                }
+            }
+        }
+        return res;
+    }
+
+    template <class V>
+    NumericMatrix operator()(const CsrView<V>& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        for (int c = 0; c < y.ncol(); c++) {
+            const double* in = &y(0, c);
+            for (int r = 0; r < x.nrow; r++) {
+                double s = 0.0;
+                for (int k = x.p[r]; k < x.p[r + 1]; k++) s += x.x[k] * in[x.j[k]];
+                res(r, c) = s;
+            }
+        }
+        return res;
+    }
+
+    template <class V>
+    NumericMatrix operator()(const TripletView<V>& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        for (int c = 0; c < y.ncol(); c++) {
+            double* out = &res(0, c);
+            const double* in = &y(0, c);
+            for (R_xlen_t k = 0; k < x.nnz; k++) out[x.i[k]] += x.x[k] * in[x.j[k]];
+        }
+        return res;
+    }
+
+    // pre-multiplication with an index matrix is a permutation of Y's rows
+    NumericMatrix operator()(const IndexView& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        for (int c = 0; c < y.ncol(); c++)
+            for (int r = 0; r < x.nrow; r++) res(r, c) = y(x.perm[r] - 1, c);
+        return res;
+    }
+
+    // dense times dense goes to BLAS through Armadillo, without copies
+    NumericMatrix operator()(const DenseView& x) const {
+        check(x.ncol);
+        NumericMatrix res(x.nrow, y.ncol());
+        const arma::mat X(const_cast<double*>(x.x), x.nrow, x.ncol, false, true);
+        const arma::mat Y(const_cast<double*>(y.begin()), y.nrow(), y.ncol(), false, true);
+        arma::mat R(res.begin(), x.nrow, y.ncol(), false, true);
+        R = X * Y;
+        return res;
+    }
+};
+
+/**
+ * ### Column Sums
+ *
+ * A second operation shows how little is needed to add one. Column sums of
+ * the symmetric half again count the off-diagonal elements twice, once for
+ * their column and once for their row.
+ */
+
+struct ColSums {
+    typedef NumericVector result_type;
+
+    template <class V>
+    NumericVector operator()(const CscView<V>& x) const {
+        NumericVector res(x.ncol);
+        for (int j = 0; j < x.ncol; j++)
+            for (int k = x.p[j]; k < x.p[j + 1]; k++) res[j] += x.x[k];
+        return res;
+    }
+
+    template <class V>
+    NumericVector operator()(const SymmetricCscView<V>& x) const {
+        NumericVector res(x.ncol);
+        for (int j = 0; j < x.ncol; j++)
+            for (int k = x.p[j]; k < x.p[j + 1]; k++) {
+                res[j] += x.x[k];
+                if (x.i[k] != j) res[x.i[k]] += x.x[k];
+            }
+        return res;
+    }
+
+    template <class V>
+    NumericVector operator()(const CsrView<V>& x) const {
+        NumericVector res(x.ncol);
+        for (int r = 0; r < x.nrow; r++)
+            for (int k = x.p[r]; k < x.p[r + 1]; k++) res[x.j[k]] += x.x[k];
+        return res;
+    }
+
+    template <class V>
+    NumericVector operator()(const TripletView<V>& x) const {
+        NumericVector res(x.ncol);
+        for (R_xlen_t k = 0; k < x.nnz; k++) res[x.j[k]] += x.x[k];
+        return res;
+    }
+
+    NumericVector operator()(const IndexView& x) const {
+        NumericVector res(x.ncol);
+        for (int r = 0; r < x.nrow; r++) res[x.perm[r] - 1] += 1.0;
+        return res;
+    }
+
+    NumericVector operator()(const DenseView& x) const {
+        NumericVector res(x.ncol);
+        for (int j = 0; j < x.ncol; j++) {
+            const double* col = x.x + (std::size_t) j * x.nrow;
+            res[j] = std::accumulate(col, col + x.nrow, 0.0);
+        }
+        return res;
+    }
+};
+
+/**
+ * The exported functions reduce to a single line each:
+ */
+
+// [[Rcpp::export]]
+NumericMatrix matmult_any(SEXP X, NumericMatrix Y) {
+    Multiply op(Y);
+    return dispatch(X, op);
+}
+
+// [[Rcpp::export]]
+NumericVector colsums_any(SEXP X) {
+    ColSums op;
+    return dispatch(X, op);
+}
+
+/**
+ * ### Checking
+ *
+ * We build each of the supported classes from the same data as the original
+ * article and compare with the Matrix package. Note that the logical and
+ * pattern versions of `X_sp` have ones wherever `X_sp` is non-zero.
+ */
+
+/*** R
+suppressMessages({
+  library(methods)
+  library(Matrix)
+})
+set.seed(12211212)
+n <- 1000
+d <- 50
+p <- 30
+
+X <- matrix(rnorm(n*d), n, d)
+X_sp <- rsparsematrix(n, d, 0.05)
+Y <- matrix(as.numeric(1:(d*p)), d, p)
+
+inputs <- list(dense = X,
+               dgC = X_sp,
+               dgR = as(X_sp, "RsparseMatrix"),
+               dgT = as(X_sp, "TsparseMatrix"),
+               lgC = X_sp != 0,
+               ngC = as(X_sp, "nMatrix"),
+               ind = as(sample(1:d, n, rep=TRUE), "indMatrix"))
+sapply(inputs, class)
+
+for (m in inputs) {
+    stopifnot(all.equal(matmult_any(m, Y), as.matrix(m %*% Y), check.attributes = FALSE),
+              all.equal(colsums_any(m), colSums(m), check.attributes = FALSE))
+}
+
+# a symmetric matrix, stored as its upper and as its lower triangle
+S <- forceSymmetric(crossprod(X_sp))
+S_low <- forceSymmetric(crossprod(X_sp), uplo = "L")
+c(class(S), S@uplo, S_low@uplo)
+for (m in list(S, S_low)) {
+    stopifnot(all.equal(matmult_any(m, Y), as.matrix(m %*% Y), check.attributes = FALSE),
+              all.equal(colsums_any(m), colSums(m), check.attributes = FALSE))
+}
+
+tryCatch(matmult_any(Diagonal(d), Y), error = print)
+*/
+
+/**
+ * ### Native Kernels versus Conversion
+ *
+ * Finally, the cost of the alternative: converting each input to a
+ * `dgCMatrix` first and then using the single CSC kernel. For the symmetric
+ * matrix the conversion also doubles the number of stored elements.
+ */
+
+/*** R
+library(rbenchmark)
+S_big <- forceSymmetric(rsparsematrix(5000, 5000, 0.01))
+T_big <- as(rsparsematrix(5000, 5000, 0.01), "TsparseMatrix")
+Y_big <- matrix(rnorm(5000 * 10), 5000, 10)
+c(stored = length(S_big@x), expanded = length(as(S_big, "generalMatrix")@x))
+
+benchmark(native_sym = matmult_any(S_big, Y_big),
+          convert_sym = matmult_any(as(S_big, "generalMatrix"), Y_big),
+          native_triplet = matmult_any(T_big, Y_big),
+          convert_triplet = matmult_any(as(T_big, "CsparseMatrix"), Y_big),
+          order = "relative", replications = 20)[,1:4]
+*/
+
+/**
+ * The native kernels avoid the conversion entirely, and the symmetric one
+ * reads only half of the elements that the expanded matrix would hold.
+ */
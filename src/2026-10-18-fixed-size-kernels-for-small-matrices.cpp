@@ -0,0 +1,467 @@
+/**
+ * @title Compile-Time Fixed-Size Kernels for Small Dense Matrices
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags armadillo matrix c++11 simulation
+ * @summary Shows how Cholesky factorisations, triangular solves, inverses and
+ *   matrix-vector products for matrices of dimension up to 8 can be written
+ *   with the dimension as a template parameter, and selected at run time.
+ *
+ * A number of articles in the gallery spend most of their time on very small
+ * matrices: the [multivariate normal
+ * density](https://gallery.rcpp.org/articles/dmvnorm_arma) is typically
+ * evaluated in two to four dimensions, the [VAR
+ * simulation](https://gallery.rcpp.org/articles/simulating-vector-autoregressive-process)
+ * multiplies by a 2 x 2 coefficient matrix at every step, and multivariate
+ * Gibbs samplers draw from low-dimensional normal distributions over and over
+ * again. For matrices of that size the arithmetic is a handful of
+ * floating-point operations, and the fixed costs of a general-purpose
+ * library dominate: a heap allocation for every temporary, run-time loops
+ * whose trip counts are unknown to the compiler, size checks, and for some
+ * operations a call into BLAS or LAPACK.
+ *
+ * Armadillo itself offers fixed-size matrices (`arma::mat::fixed<n, m>`) for
+ * this reason. Here we go one step further and write the handful of kernels
+ * that these examples need as templates on the dimension `N`. All loop
+ * bounds are then compile-time constants, the matrices live in local arrays
+ * of `N * N` doubles, and after inlining the compiler can keep everything in
+ * registers. A small dispatcher turns the run-time dimension into the
+ * template argument, so that callers never see the templates.
+ */
+
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::plugins(cpp11)]]
+#include <RcppArmadillo.h>
+
+#include <cmath>
+
+/**
+ * ### Forcing Full Unrolling
+ *
+ * A loop with a constant trip count of, say, three is usually unrolled by
+ * the optimiser, but there is no guarantee, and R's default `-O2` is fairly
+ * conservative about it. The `Unroll` template below makes the unrolling
+ * explicit: it calls `f(0)`, `f(1)`, ..., `f(N - 1)` through a chain of
+ * inlined template instantiations, so that every index is a constant in the
+ * generated code.
+ */
+
+template <int I, int N>
+struct Unroll {
+    template <typename F>
+    static inline void run(F&& f) {
+        f(I);
+        Unroll<I + 1, N>::run(f);
+    }
+};
+
+template <int N>
+struct Unroll<N, N> {
+    template <typename F>
+    static inline void run(F&&) {}
+};
+
+/**
+ * ### The Kernels
+ *
+ * All matrices are stored in column-major order like R and Armadillo, and
+ * the Cholesky factor is lower triangular, `A = L L'`. The solves work in
+ * place on a vector of length `N`.
+ */
+
+template <int N>
+struct Small {
+
+    static inline void load(const arma::mat& A, double* a) {
+        Unroll<0, N * N>::run([&](int k) { a[k] = A[k]; });
+    }
+
+    // lower Cholesky factor; returns false unless A is positive definite
+    static inline bool chol(const double* a, double* L) {
+        bool ok = true;
+        Unroll<0, N>::run([&](int j) {
+            double d = a[j + j * N];
+            Unroll<0, N>::run([&](int k) { if (k < j) d -= L[j + k * N] * L[j + k * N]; });
+            ok = ok && d > 0.0;
+            d = std::sqrt(d);
+            L[j + j * N] = d;
+            Unroll<0, N>::run([&](int i) {
+                if (i < j) {
+                    L[i + j * N] = 0.0;
+                } else if (i > j) {
+                    double s = a[i + j * N];
+                    Unroll<0, N>::run([&](int k) { if (k < j) s -= L[i + k * N] * L[j + k * N]; });
+                    L[i + j * N] = s / d;
+                }
+            });
+        });
+        return ok;
+    }
+
+    // solve L y = b, overwriting b with y
+    static inline void forward(const double* L, double* b) {
+        Unroll<0, N>::run([&](int i) {
+            double s = b[i];
+            Unroll<0, N>::run([&](int k) { if (k < i) s -= L[i + k * N] * b[k]; });
+            b[i] = s / L[i + i * N];
+        });
+    }
+
+    // solve L' x = y, overwriting y with x
+    static inline void backward(const double* L, double* b) {
+        Unroll<0, N>::run([&](int ii) {
+            const int i = N - 1 - ii;
+            double s = b[i];
+            Unroll<0, N>::run([&](int k) { if (k > i) s -= L[k + i * N] * b[k]; });
+            b[i] = s / L[i + i * N];
+        });
+    }
+
+    // y = A x
+    static inline void matvec(const double* a, const double* x, double* y) {
+        Unroll<0, N>::run([&](int i) {
+            double s = 0.0;
+            Unroll<0, N>::run([&](int k) { s += a[i + k * N] * x[k]; });
+            y[i] = s;
+        });
+    }
+
+    // inverse of A = L L', column by column
+    static inline void chol_inverse(const double* L, double* inv) {
+        Unroll<0, N>::run([&](int j) {
+            double e[N];
+            Unroll<0, N>::run([&](int i) { e[i] = (i == j) ? 1.0 : 0.0; });
+            forward(L, e);
+            backward(L, e);
+            Unroll<0, N>::run([&](int i) { inv[i + j * N] = e[i]; });
+        });
+    }
+};
+
+/**
+ * ### Dispatching on the Run-Time Dimension
+ *
+ * Each entry point is written as a class template `Kernel<N>` with a static
+ * `run()` function. `Kernel<0>` is the general case, written with ordinary
+ * Armadillo code, and is used for dimensions above eight. The dispatcher
+ * maps the run-time dimension to the matching instantiation; it is the only
+ * place where the set of supported dimensions is spelled out.
+ */
+
+template <template <int> class Kernel, typename... Args>
+inline auto dispatch(int n, Args&&... args)
+    -> decltype(Kernel<0>::run(std::forward<Args>(args)...)) {
+    switch (n) {
+    case 1: return Kernel<1>::run(std::forward<Args>(args)...);
+    case 2: return Kernel<2>::run(std::forward<Args>(args)...);
+    case 3: return Kernel<3>::run(std::forward<Args>(args)...);
+    case 4: return Kernel<4>::run(std::forward<Args>(args)...);
+    case 5: return Kernel<5>::run(std::forward<Args>(args)...);
+    case 6: return Kernel<6>::run(std::forward<Args>(args)...);
+    case 7: return Kernel<7>::run(std::forward<Args>(args)...);
+    case 8: return Kernel<8>::run(std::forward<Args>(args)...);
+    default: return Kernel<0>::run(std::forward<Args>(args)...);
+    }
+}
+
+/**
+ * ### Multivariate Normal Density
+ *
+ * With `sigma = L L'`, the log density of `x` is
+ * `-d/2 log(2 pi) - sum(log(diag(L))) - 1/2 |z|^2` where `z` solves
+ * `L z = x - mean`. The fixed-size version factors `sigma` once, and then
+ * for every row performs a single forward solve on `N` doubles held in
+ * registers. The general version is the `dmvnrm_arma` function of the
+ * original article.
+ */
+
+static double const log2pi = std::log(2.0 * M_PI);
+
+template <int N>
+struct DmvnormKernel {
+    static arma::vec run(const arma::mat& x, const arma::rowvec& mean,
+                         const arma::mat& sigma) {
+        double a[N * N], L[N * N], mu[N];
+        Small<N>::load(sigma, a);
+        if (!Small<N>::chol(a, L)) Rcpp::stop("'sigma' is not positive definite");
+        double other_terms = -N / 2.0 * log2pi;
+        Unroll<0, N>::run([&](int k) { other_terms -= std::log(L[k + k * N]); mu[k] = mean[k]; });
+
+        const arma::uword n = x.n_rows;
+        arma::vec out(n);
+        for (arma::uword i = 0; i < n; i++) {
+            double z[N];
+            Unroll<0, N>::run([&](int k) { z[k] = x(i, k) - mu[k]; });
+            Small<N>::forward(L, z);
+            double ss = 0.0;
+            Unroll<0, N>::run([&](int k) { ss += z[k] * z[k]; });
+            out[i] = other_terms - 0.5 * ss;
+        }
+        return out;
+    }
+};
+
+template <>
+struct DmvnormKernel<0> {
+    static arma::vec run(const arma::mat& x, const arma::rowvec& mean,
+                         const arma::mat& sigma) {
+        const arma::uword n = x.n_rows, xdim = x.n_cols;
+        arma::vec out(n);
+        arma::mat const rooti = arma::inv(trimatu(arma::chol(sigma)));
+        double const other_terms = arma::sum(log(rooti.diag())) - (double)xdim/2.0 * log2pi;
+        arma::rowvec z;
+        for (arma::uword i = 0; i < n; i++) {
+            z      = (x.row(i) - mean) * rooti;
+            out(i) = other_terms - 0.5 * arma::dot(z, z);
+        }
+        return out;
+    }
+};
+
+// [[Rcpp::export]]
+arma::vec dmvnrm_small(arma::mat const &x, arma::rowvec const &mean,
+                       arma::mat const &sigma, bool const logd = false) {
+    if (x.n_cols != mean.n_elem || sigma.n_rows != mean.n_elem ||
+        sigma.n_cols != mean.n_elem)
+        Rcpp::stop("non-conformable arguments");
+    arma::vec out = dispatch<DmvnormKernel>(mean.n_elem, x, mean, sigma);
+    return logd ? out : arma::exp(out);
+}
+
+/**
+ * ### VAR Simulation
+ *
+ * The `rcppSim` function of the VAR article computes
+ * `simdata.row(row-1) * trans(coeff) + errors.row(row)` in every step, which
+ * creates several temporaries per step for what is, in the 2 x 2 case, four
+ * multiplications and four additions. The fixed-size version keeps the
+ * coefficients and the current state in local arrays for the whole run:
+ */
+
+template <int N>
+struct VarSimKernel {
+    static arma::mat run(const arma::mat& coeff, const arma::mat& errors) {
+        double A[N * N], y[N], ynew[N];
+        Small<N>::load(coeff, A);
+        const arma::uword m = errors.n_rows;
+        arma::mat simdata(m, N);
+        Unroll<0, N>::run([&](int k) { y[k] = 0.0; simdata(0, k) = 0.0; });
+        for (arma::uword row = 1; row < m; row++) {
+            Small<N>::matvec(A, y, ynew);
+            Unroll<0, N>::run([&](int k) {
+                y[k] = ynew[k] + errors(row, k);
+                simdata(row, k) = y[k];
+            });
+        }
+        return simdata;
+    }
+};
+
+template <>
+struct VarSimKernel<0> {
+    static arma::mat run(const arma::mat& coeff, const arma::mat& errors) {
+        int m = errors.n_rows; int n = errors.n_cols;
+        arma::mat simdata(m,n);
+        simdata.row(0) = arma::zeros<arma::mat>(1,n);
+        for (int row=1; row<m; row++) {
+            simdata.row(row) = simdata.row(row-1)*trans(coeff)+errors.row(row);
+        }
+        return simdata;
+    }
+};
+
+// [[Rcpp::export]]
+arma::mat rcppSim_small(const arma::mat& coeff, const arma::mat& errors) {
+    if (coeff.n_rows != coeff.n_cols || coeff.n_cols != errors.n_cols)
+        Rcpp::stop("non-conformable arguments");
+    if (errors.n_rows == 0) return arma::mat(0, errors.n_cols);
+    return dispatch<VarSimKernel>(errors.n_cols, coeff, errors);
+}
+
+/**
+ * ### Drawing from a Multivariate Normal
+ *
+ * The inner step of a multivariate Gibbs sampler is often a draw from a
+ * low-dimensional normal distribution, `mean + L z` with standard normal
+ * `z`. Here the factor is computed once and reused for all `n` draws:
+ */
+
+template <int N>
+struct RmvnormKernel {
+    static arma::mat run(int n, const arma::vec& mean, const arma::mat& sigma) {
+        double a[N * N], L[N * N];
+        Small<N>::load(sigma, a);
+        if (!Small<N>::chol(a, L)) Rcpp::stop("'sigma' is not positive definite");
+        arma::mat out(n, N);
+        for (int i = 0; i < n; i++) {
+            double z[N];
+            Unroll<0, N>::run([&](int k) { z[k] = R::norm_rand(); });
+            Unroll<0, N>::run([&](int r) {
+                double s = mean[r];
+                Unroll<0, N>::run([&](int k) { if (k <= r) s += L[r + k * N] * z[k]; });
+                out(i, r) = s;
+            });
+        }
+        return out;
+    }
+};
+
+template <>
+struct RmvnormKernel<0> {
+    static arma::mat run(int n, const arma::vec& mean, const arma::mat& sigma) {
+        arma::mat L = arma::chol(sigma, "lower");
+        arma::mat out(n, mean.n_elem);
+        for (int i = 0; i < n; i++) {
+            arma::vec z(mean.n_elem);
+            for (arma::uword k = 0; k < z.n_elem; k++) z[k] = R::norm_rand();
+            out.row(i) = arma::trans(mean + L * z);
+        }
+        return out;
+    }
+};
+
+// [[Rcpp::export]]
+arma::mat rmvnorm_small(int n, const arma::vec& mean, const arma::mat& sigma) {
+    if (sigma.n_rows != mean.n_elem || sigma.n_cols != mean.n_elem)
+        Rcpp::stop("non-conformable arguments");
+    return dispatch<RmvnormKernel>(mean.n_elem, n, mean, sigma);
+}
+
+/**
+ * ### Solve and Inverse
+ *
+ * Finally, the symmetric positive definite solve and inverse, both through
+ * the fixed-size Cholesky factor:
+ */
+
+template <int N>
+struct SpdSolveKernel {
+    static arma::vec run(const arma::mat& A, const arma::vec& b) {
+        double a[N * N], L[N * N], x[N];
+        Small<N>::load(A, a);
+        if (!Small<N>::chol(a, L)) Rcpp::stop("'A' is not positive definite");
+        Unroll<0, N>::run([&](int k) { x[k] = b[k]; });
+        Small<N>::forward(L, x);
+        Small<N>::backward(L, x);
+        return arma::vec(x, N);
+    }
+};
+
+template <>
+struct SpdSolveKernel<0> {
+    static arma::vec run(const arma::mat& A, const arma::vec& b) {
+        return arma::solve(arma::symmatu(A), b);
+    }
+};
+
+template <int N>
+struct SpdInverseKernel {
+    static arma::mat run(const arma::mat& A) {
+        double a[N * N], L[N * N], inv[N * N];
+        Small<N>::load(A, a);
+        if (!Small<N>::chol(a, L)) Rcpp::stop("'A' is not positive definite");
+        Small<N>::chol_inverse(L, inv);
+        return arma::mat(inv, N, N);
+    }
+};
+
+template <>
+struct SpdInverseKernel<0> {
+    static arma::mat run(const arma::mat& A) {
+        return arma::inv_sympd(A);
+    }
+};
+
+// [[Rcpp::export]]
+arma::vec spd_solve_small(const arma::mat& A, const arma::vec& b) {
+    if (A.n_rows != A.n_cols || A.n_rows != b.n_elem)
+        Rcpp::stop("non-conformable arguments");
+    return dispatch<SpdSolveKernel>(A.n_rows, A, b);
+}
+
+// [[Rcpp::export]]
+arma::mat spd_inverse_small(const arma::mat& A) {
+    if (A.n_rows != A.n_cols) Rcpp::stop("'A' must be square");
+    return dispatch<SpdInverseKernel>(A.n_rows, A);
+}
+
+/**
+ * ### Correctness
+ *
+ * Every kernel is compared against base R, for all the fixed sizes and one
+ * dimension that takes the general path:
+ */
+
+/*** R
+set.seed(123)
+for (d in c(1:8, 12)) {
+    S <- crossprod(matrix(rnorm(4 * d * d), 4 * d, d)) / d + diag(d)
+    mu <- rnorm(d)
+    X <- matrix(rnorm(50 * d), 50, d)
+
+    # reference log density
+    Xc <- sweep(X, 2, mu)
+    ref <- -d/2 * log(2*pi) - 0.5 * determinant(S)$modulus -
+        0.5 * rowSums((Xc %*% solve(S)) * Xc)
+    stopifnot(all.equal(dmvnrm_small(X, mu, S, TRUE), as.vector(ref)))
+
+    b <- rnorm(d)
+    stopifnot(all.equal(spd_solve_small(S, b), as.matrix(solve(S, b))))
+    stopifnot(all.equal(spd_inverse_small(S), solve(S)))
+
+    A <- matrix(runif(d * d, -0.5, 0.5), d, d) / d
+    E <- matrix(rnorm(20 * d), 20, d)
+    ref <- matrix(0, 20, d)
+    for (r in 2:20) ref[r, ] <- A %*% ref[r - 1, ] + E[r, ]
+    stopifnot(all.equal(rcppSim_small(A, E), ref))
+}
+
+# moments of the multivariate normal draws
+S <- matrix(c(1, 0.8, 0.8, 2), 2, 2)
+draws <- rmvnorm_small(1e5, c(1, -1), S)
+round(colMeans(draws), 2)
+round(cov(draws), 2)
+*/
+
+/**
+ * ### Benchmarks
+ *
+ * For the two-dimensional density and the 2 x 2 VAR from the original
+ * articles, the fixed-size kernels against the general Armadillo code:
+ */
+
+/*** R
+library(rbenchmark)
+Rcpp::cppFunction(depends = "RcppArmadillo", '
+arma::mat rcppSim(arma::mat coeff, arma::mat errors) {
+   int m = errors.n_rows; int n = errors.n_cols;
+   arma::mat simdata(m,n);
+   simdata.row(0) = arma::zeros<arma::mat>(1,n);
+   for (int row=1; row<m; row++) {
+      simdata.row(row) = simdata.row(row-1)*trans(coeff)+errors.row(row);
+   }
+   return simdata;
+}')
+
+a <- matrix(c(0.5,0.1,0.1,0.5),nrow=2)
+e <- matrix(rnorm(20000),ncol=2)
+stopifnot(all.equal(rcppSim(a, e), rcppSim_small(a, e)))
+
+sigma <- matrix(c(1, 0.5, 0.5, 2), 2, 2)
+means <- rnorm(2)
+X <- matrix(rnorm(2e5), ncol = 2)
+
+benchmark(rcppSim(a, e),
+          rcppSim_small(a, e),
+          mvtnorm::dmvnorm(X, means, sigma, log = FALSE),
+          dmvnrm_small(X, means, sigma, FALSE),
+          order = "relative", replications = 100)[,1:4]
+*/
+
+/**
+ * The general path stays available for larger dimensions, and the
+ * dispatcher is easily extended by adding more `case` labels; beyond a
+ * dimension of about eight, however, the fully unrolled code grows
+ * quadratically while BLAS-backed Armadillo catches up, so there is little
+ * to gain.
+ */
@@ -0,0 +1,468 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Memoised Parsing of Repetitive String Columns
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags boost date benchmark
+ * @summary Parses each distinct string of a character vector only once, by
+ *   remembering results by the address of the string, and switches the
+ *   cache off again when most strings turn out to be distinct.
+ *
+ * Columns read from log files or trade records are often highly repetitive:
+ * ten million rows may hold only a few thousand distinct dates, prices or
+ * account numbers. Functions like `toPOSIXct()` from the article on [parsing
+ * dates and times](https://gallery.rcpp.org/articles/parsing-datetimes), or
+ * `lexicalCast()` from [a second Boost
+ * example](https://gallery.rcpp.org/articles/a-second-boost-example),
+ * nevertheless parse every element from scratch, so almost all of their work
+ * repeats work already done.
+ *
+ * R makes it cheap to notice a repeat. All strings are kept in a global
+ * cache of `CHARSXP`s, and equal strings in the same encoding share a single
+ * `CHARSXP`. Two elements of a character vector which point to the same
+ * `CHARSXP` therefore hold the same string, so we can compare and hash the
+ * pointers and never look at the characters. (The converse fails only for
+ * equal strings with different encoding marks, which are then simply parsed
+ * twice.) We use that to parse each distinct string once and copy its
+ * result to every element that holds it.
+ */
+
+// [[Rcpp::depends(BH)]]
+// [[Rcpp::plugins(cpp11)]]
+#include <Rcpp.h>
+#include <boost/lexical_cast.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <regex>
+#include <string>
+#include <unordered_map>
+
+using namespace Rcpp;
+
+/**
+ * ### The Cache
+ *
+ * Rather than results, the cache stores for each `CHARSXP` the position of
+ * the first element which held it. When the same string comes along again,
+ * the caller copies the result it computed at that position. This keeps
+ * the cache independent of the result type, and it is also safe for
+ * results which are themselves R objects: a string produced once is stored
+ * in the (protected) result vector right away, and later elements just
+ * point to the same `CHARSXP`, so there is nothing left unprotected in the
+ * cache for the garbage collector to take away.
+ *
+ * A hash table lookup is not free, so for columns in which most strings are
+ * distinct the cache only costs time and memory. It therefore watches its
+ * own hit rate: every `window` lookups it checks how many of them found a
+ * new string, and if that was more than half, it clears itself and stays
+ * off for the rest of the vector. Sorted columns, where equal strings come
+ * in runs, are served before the hash table is even consulted, by comparing
+ * with the previous string.
+ */
+
+class StringMemo {
+public:
+    explicit StringMemo(bool enabled, std::size_t window = 100000)
+        : enabled(enabled), window(window), last(NULL), last_pos(0),
+          lookups(0), misses(0) {}
+
+    // returns the position of an earlier element holding s, or -1
+    R_xlen_t earlier(SEXP s, R_xlen_t i) {
+        if (!enabled) return -1;
+        if (s == last) return last_pos;
+        last = s;
+        std::pair<std::unordered_map<SEXP, R_xlen_t>::iterator, bool> ins =
+            seen.emplace(s, i);
+        last_pos = ins.first->second;
+        if (ins.second) misses++;
+        if (++lookups == window) {
+            if (2 * misses > window) {
+                enabled = false;
+                std::unordered_map<SEXP, R_xlen_t>().swap(seen);
+            }
+            lookups = misses = 0;
+        }
+        return ins.second ? -1 : last_pos;
+    }
+
+private:
+    bool enabled;
+    const std::size_t window;
+    std::unordered_map<SEXP, R_xlen_t> seen;
+    SEXP last;
+    R_xlen_t last_pos;
+    std::size_t lookups, misses;
+};
+
+/**
+ * Every parser below follows the same pattern: ask the cache whether the
+ * string was seen before, copy the earlier result if it was, and parse
+ * otherwise. The `memo` argument turns the cache off, for comparison.
+ *
+ * ### Dates and Times
+ *
+ * For dates and times we use the allocation-free scanner from the article
+ * on [parsing dates and times without
+ * streams](https://gallery.rcpp.org/articles/fast-datetime-parsing),
+ * unchanged; see there for how it works. Even this scanner has to look at
+ * every character of a string, while the cache only has to look at its
+ * address.
+ */
+
+namespace dt {
+
+struct Fields {
+    int year, month, day;
+    int hour, minute, second;
+    int nanos;
+};
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// reads exactly n digits
+inline bool digits(const char*& p, const char* end, int n, int& out) {
+    if (end - p < n) return false;
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        if (!is_digit(p[i])) return false;
+        v = 10 * v + (p[i] - '0');
+    }
+    p += n;
+    out = v;
+    return true;
+}
+
+inline bool literal(const char*& p, const char* end, char c) {
+    if (p == end || *p != c) return false;
+    ++p;
+    return true;
+}
+
+// skips one optional date separator
+inline void separator(const char*& p, const char* end) {
+    if (p != end && (*p == '-' || *p == '/' || *p == ' ')) ++p;
+}
+
+const char* const month_names[] = {
+    "january", "february", "march", "april", "may", "june", "july",
+    "august", "september", "october", "november", "december"
+};
+
+inline bool month_name(const char*& p, const char* end, int& month) {
+    if (end - p < 3) return false;
+    const char a = p[0] | 0x20, b = p[1] | 0x20, c = p[2] | 0x20;
+    for (int m = 0; m < 12; m++) {
+        const char* name = month_names[m];
+        if (name[0] != a || name[1] != b || name[2] != c) continue;
+        p += 3;
+        const char* rest = name + 3;
+        const char* q = p;
+        while (*rest && q != end && (*q | 0x20) == *rest) { ++q; ++rest; }
+        if (*rest == '\0') p = q;
+        month = m + 1;
+        return true;
+    }
+    return false;
+}
+
+inline bool is_leap(int y) {
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+inline int days_in_month(int y, int m) {
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    return m == 2 && is_leap(y) ? 29 : days[m - 1];
+}
+
+inline bool valid_date(const Fields& f) {
+    return f.month >= 1 && f.month <= 12 &&
+        f.day >= 1 && f.day <= days_in_month(f.year, f.month);
+}
+
+inline bool time_of_day(const char* p, const char* end, Fields& f) {
+    f.hour = f.minute = f.second = f.nanos = 0;
+    if (p != end) {
+        if (*p != ' ' && *p != 'T') return false;
+        ++p;
+        if (!digits(p, end, 2, f.hour) || !literal(p, end, ':') ||
+            !digits(p, end, 2, f.minute)) return false;
+        if (literal(p, end, ':')) {
+            if (!digits(p, end, 2, f.second)) return false;
+            if (p != end && (*p == '.' || *p == ',')) {
+                const char* start = ++p;
+                int scale = 100000000;
+                for (; p != end && is_digit(*p); ++p) {
+                    f.nanos += (*p - '0') * scale;
+                    scale /= 10;
+                }
+                if (p == start) return false;
+            }
+        }
+        literal(p, end, 'Z');
+    }
+    return p == end && f.hour < 24 && f.minute < 60 && f.second < 60 &&
+        valid_date(f);
+}
+
+inline bool ymd(const char* p, const char* end, char sep, Fields& f) {
+    return digits(p, end, 4, f.year) && literal(p, end, sep) &&
+        digits(p, end, 2, f.month) && literal(p, end, sep) &&
+        digits(p, end, 2, f.day) && time_of_day(p, end, f);
+}
+
+inline bool iso(const char* p, const char* end, Fields& f) {
+    return ymd(p, end, '-', f);
+}
+
+inline bool slashed(const char* p, const char* end, Fields& f) {
+    return ymd(p, end, '/', f);
+}
+
+inline bool compact(const char* p, const char* end, Fields& f) {
+    return digits(p, end, 4, f.year) && digits(p, end, 2, f.month) &&
+        digits(p, end, 2, f.day) && time_of_day(p, end, f);
+}
+
+inline bool year_monthname_day(const char* p, const char* end, Fields& f) {
+    if (!digits(p, end, 4, f.year)) return false;
+    separator(p, end);
+    if (!month_name(p, end, f.month)) return false;
+    separator(p, end);
+    return digits(p, end, 2, f.day) && time_of_day(p, end, f);
+}
+
+inline bool monthname_day_year(const char* p, const char* end, Fields& f) {
+    if (!month_name(p, end, f.month)) return false;
+    separator(p, end);
+    if (!digits(p, end, 2, f.day)) return false;
+    separator(p, end);
+    return digits(p, end, 4, f.year) && time_of_day(p, end, f);
+}
+
+typedef bool (*Scanner)(const char*, const char*, Fields&);
+
+const Scanner scanners[] = {
+    iso, slashed, compact, year_monthname_day, monthname_day_year
+};
+const int nscanners = sizeof(scanners) / sizeof(scanners[0]);
+
+inline int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * INT64_C(146097) + static_cast<int64_t>(doe) - 719468;
+}
+
+inline double to_seconds(const Fields& f) {
+    const int64_t secs = days_from_civil(f.year, f.month, f.day) * 86400 +
+        f.hour * 3600 + f.minute * 60 + f.second;
+    return secs + f.nanos / 1.0e9;
+}
+
+class Parser {
+public:
+    Parser() : preferred(-1) {}
+
+    bool parse(const char* s, std::size_t len, Fields& f) {
+        const char* end = s + len;
+        if (preferred >= 0 && scanners[preferred](s, end, f)) return true;
+        for (int i = 0; i < nscanners; i++) {
+            if (i == preferred || !scanners[i](s, end, f)) continue;
+            if (preferred < 0) preferred = i;
+            return true;
+        }
+        return false;
+    }
+
+    double seconds(const char* s, std::size_t len) {
+        Fields f;
+        return parse(s, len, f) ? to_seconds(f) : NA_REAL;
+    }
+
+private:
+    int preferred;
+};
+
+}
+
+
+// [[Rcpp::export]]
+NumericVector memoToPOSIXct(CharacterVector x, bool memo = true) {
+    const R_xlen_t n = x.size();
+    NumericVector out(n);
+    StringMemo cache(memo);
+    dt::Parser parser;
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        SEXP s = STRING_ELT(x, i);
+        const R_xlen_t j = cache.earlier(s, i);
+        if (j >= 0) {
+            out[i] = out[j];
+        } else if (s == NA_STRING) {
+            out[i] = NA_REAL;
+        } else {
+            const int l = LENGTH(s);
+            if (l < 8 || l == 9) {
+                stop("Inadmissable input: %s", CHAR(s));
+            }
+            out[i] = parser.seconds(CHAR(s), l);
+        }
+    }
+    out.attr("class") = CharacterVector::create("POSIXct", "POSIXt");
+    return out;
+}
+
+/**
+ * ### Numbers
+ *
+ * `lexicalCast()` signals a string which is not a number by throwing an
+ * exception, which is expensive. In dirty data, where a tenth of the
+ * entries may be `"n/a"`, `"-"` or similar, the exceptions can take more
+ * time than the conversions. With the cache, each distinct bad string
+ * throws only once. We also read directly from the `CHARSXP` rather than
+ * from a `std::vector<std::string>` copy of the whole input.
+ */
+
+// [[Rcpp::export]]
+NumericVector memoLexicalCast(CharacterVector x, bool memo = true) {
+    const R_xlen_t n = x.size();
+    NumericVector out(n);
+    StringMemo cache(memo);
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        SEXP s = STRING_ELT(x, i);
+        const R_xlen_t j = cache.earlier(s, i);
+        if (j >= 0) {
+            out[i] = out[j];
+        } else if (s == NA_STRING) {
+            out[i] = NA_REAL;
+        } else {
+            try {
+                out[i] = boost::lexical_cast<double>(CHAR(s), LENGTH(s));
+            } catch (boost::bad_lexical_cast &) {
+                out[i] = NA_REAL;
+            }
+        }
+    }
+    return out;
+}
+
+/**
+ * ### Regular Expressions
+ *
+ * The article on [Boost
+ * regular expressions](https://gallery.rcpp.org/articles/boost-regular-expressions)
+ * validates credit card numbers and rewrites them in two formats. Here the
+ * cache pays off twice: the expressions run once per distinct string, and
+ * the two rewritten strings are turned into `CHARSXP`s once, after which
+ * all elements with the same input share them. We use the C++11
+ * `std::regex` rather than Boost.Regex, as the latter needs a compiled
+ * library to link against. Its default ECMAScript grammar has no `\A` and
+ * `\z`, so the anchors become `^` and `$`, and `$1` replaces `\1` in the
+ * formats.
+ */
+
+bool validate_card_format(const std::string& s) {
+    static const std::regex e("(\\d{4}[- ]){3}\\d{4}");
+    return std::regex_match(s, e);
+}
+
+const std::regex e("^(\\d{3,4})[- ]?(\\d{4})[- ]?(\\d{4})[- ]?(\\d{4})$");
+const std::string machine_format("$1$2$3$4");
+const std::string human_format("$1-$2-$3-$4");
+
+// [[Rcpp::export]]
+DataFrame memoRegexDemo(CharacterVector x, bool memo = true) {
+    const R_xlen_t n = x.size();
+    LogicalVector valid(n);
+    CharacterVector machine(n), human(n);
+    StringMemo cache(memo);
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        SEXP s = STRING_ELT(x, i);
+        const R_xlen_t j = cache.earlier(s, i);
+        if (j >= 0) {
+            valid[i] = valid[j];
+            SET_STRING_ELT(machine, i, STRING_ELT(machine, j));
+            SET_STRING_ELT(human, i, STRING_ELT(human, j));
+        } else if (s == NA_STRING) {
+            valid[i] = NA_LOGICAL;
+            SET_STRING_ELT(machine, i, NA_STRING);
+            SET_STRING_ELT(human, i, NA_STRING);
+        } else {
+            const std::string str(CHAR(s), LENGTH(s));
+            valid[i] = validate_card_format(str);
+            machine[i] = std::regex_replace(str, e, machine_format);
+            human[i] = std::regex_replace(str, e, human_format);
+        }
+    }
+    return DataFrame::create(Named("input") = x,
+                             Named("valid") = valid,
+                             Named("machine") = machine,
+                             Named("human") = human);
+}
+
+/**
+ * ## Illustration
+ *
+ * With few distinct strings, the results do not change, but the time does.
+ * We draw ten million timestamps from a single year of days:
+ */
+
+/*** R
+days <- format(seq(as.POSIXct("2026-01-01", tz="UTC"), by="1 day", length.out=365),
+               "%Y-%m-%d %H:%M:%S", tz="UTC")
+x <- sample(days, 1e7, replace=TRUE)
+stopifnot(identical(memoToPOSIXct(x), memoToPOSIXct(x, memo=FALSE)))
+
+library(rbenchmark)
+benchmark(memo = memoToPOSIXct(x),
+          nomemo = memoToPOSIXct(x, memo=FALSE),
+          order = "relative", replications = 3)[,1:4]
+*/
+
+/**
+ * For numbers with a tenth of invalid entries, the savings come mostly from
+ * the exceptions which are no longer thrown:
+ */
+
+/*** R
+prices <- c(sprintf("%.2f", runif(1000, 10, 100)), "n/a", "-", "#VALUE!")
+y <- sample(prices, 1e6, replace=TRUE, prob=c(rep(0.9/1000, 1000), rep(0.1/3, 3)))
+stopifnot(identical(memoLexicalCast(y), memoLexicalCast(y, memo=FALSE)))
+benchmark(memo = memoLexicalCast(y),
+          nomemo = memoLexicalCast(y, memo=FALSE),
+          order = "relative", replications = 3)[,1:4]
+*/
+
+/**
+ * The credit card example gives the same results as the Boost version:
+ */
+
+/*** R
+s <- c("0000111122223333", "0000 1111 2222 3333", "0000-1111-2222-3333", "000-1111-2222-3333")
+memoRegexDemo(s)
+cards <- sample(s, 1e5, replace=TRUE)
+benchmark(memo = memoRegexDemo(cards),
+          nomemo = memoRegexDemo(cards, memo=FALSE),
+          order = "relative", replications = 3)[,1:4]
+*/
+
+/**
+ * ### High Cardinality
+ *
+ * When every string is distinct, the cache finds nothing. After its first
+ * window of lookups it switches itself off, so it costs only those lookups
+ * and the time stays close to that without it:
+ */
+
+/*** R
+z <- format(as.POSIXct("2020-01-01", tz="UTC") + runif(1e7, 0, 1e8),
+            "%Y-%m-%d %H:%M:%OS6", tz="UTC")
+benchmark(memo = memoToPOSIXct(z),
+          nomemo = memoToPOSIXct(z, memo=FALSE),
+          order = "relative", replications = 3)[,1:4]
+*/
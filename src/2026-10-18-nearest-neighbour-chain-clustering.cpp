@@ -0,0 +1,335 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Hierarchical Clustering with the Nearest-Neighbour Chain
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags stats modeling benchmark
+ * @summary Implements agglomerative clustering with single, complete,
+ *   average and Ward linkage by the nearest-neighbour chain algorithm in
+ *   O(n^2) time, working on the packed distances of a dist object and
+ *   returning an hclust object.
+ *
+ * The article on [parallel distance matrix
+ * calculation](https://gallery.rcpp.org/articles/parallel-distance-matrix)
+ * computes distances in order to feed them to clustering tools such as
+ * `hclust()`. This article provides the clustering step itself in C++.
+ *
+ * Agglomerative clustering starts with every observation in a cluster of
+ * its own and repeatedly merges the two closest clusters, where the
+ * distance between clusters is derived from the distances between
+ * observations by the *linkage*. Done naively, by searching the whole
+ * distance matrix for the closest pair at each of the `n - 1` steps, that
+ * takes O(n^3) time.
+ *
+ * The *nearest-neighbour chain* algorithm does it in O(n^2). It follows a
+ * chain of nearest neighbours, from any cluster to its nearest neighbour,
+ * to that one's nearest neighbour, and so on, until it reaches two
+ * clusters which are each other's nearest neighbours. Those two can be
+ * merged right away: for the linkages considered here, which are
+ * *reducible*, merging them never makes another cluster closer to a third,
+ * so the rest of the chain remains valid and the walk continues from
+ * where it was. Every step of the chain costs O(n), and there are at most
+ * about `3n` of them. See [Müllner
+ * (2011)](https://arxiv.org/abs/1109.2378) for a thorough discussion and
+ * the [fastcluster](https://cran.r-project.org/package=fastcluster)
+ * package for a production implementation.
+ */
+
+#include <Rcpp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using namespace Rcpp;
+
+/**
+ * ### Packed Distances
+ *
+ * A `dist` object stores the lower triangle of the distance matrix column
+ * by column: the distances from observation 1 to observations 2, ..., n,
+ * then from 2 to 3, ..., n, and so on. A small accessor finds the entry of
+ * a pair in that vector. As the clusters are merged, the distances to the
+ * merged cluster overwrite those of one of the two, so no other storage is
+ * needed. Offsets are computed in `std::size_t`, since `n (n - 1) / 2`
+ * overflows an `int` above 65,536 observations.
+ */
+
+class Packed {
+public:
+    Packed(double* d, std::size_t n) : d(d), n(n) {}
+
+    double& operator()(std::size_t i, std::size_t j) {
+        if (i < j) std::swap(i, j);
+        return d[n * j - j * (j + 1) / 2 + i - j - 1];
+    }
+
+private:
+    double* d;
+    std::size_t n;
+};
+
+/**
+ * ### Linkages
+ *
+ * The distances from a new cluster `a + b` to every other cluster `k`
+ * follow from those of `a` and `b` by the Lance-Williams formulas, with
+ * `na`, `nb` and `nk` the cluster sizes:
+ *
+ * - single linkage: `min(d(a, k), d(b, k))`
+ * - complete linkage: `max(d(a, k), d(b, k))`
+ * - average linkage: `(na d(a, k) + nb d(b, k)) / (na + nb)`
+ * - Ward: `((na + nk) d(a, k) + (nb + nk) d(b, k) - nk d(a, b)) / (na + nb + nk)`
+ *
+ * `hclust()` has two variants of Ward's method. `ward.D2` applies the
+ * formula to squared distances and reports the square root of the merge
+ * heights, which is Ward's original criterion; `ward.D` applies it to the
+ * distances as given. We offer both, with the same names.
+ */
+
+enum Linkage { SINGLE, COMPLETE, AVERAGE, WARD };
+
+inline double lance_williams(Linkage linkage, double dak, double dbk, double dab,
+                             double na, double nb, double nk) {
+    switch (linkage) {
+    case SINGLE: return std::min(dak, dbk);
+    case COMPLETE: return std::max(dak, dbk);
+    case AVERAGE: return (na * dak + nb * dbk) / (na + nb);
+    default: return ((na + nk) * dak + (nb + nk) * dbk - nk * dab) / (na + nb + nk);
+    }
+}
+
+/**
+ * ### The Chain
+ *
+ * The clusters still active are kept in a doubly linked list, so that the
+ * nearest neighbour search skips the merged ones. A merged cluster takes
+ * the place of `b`, and `a` is removed from the list. When looking for the
+ * nearest neighbour of the top of the chain, ties are resolved in favour of
+ * the previous element of the chain; otherwise, with equal distances, the
+ * chain could go round in circles.
+ *
+ * Merges are recorded as the pairs of observations that represent the two
+ * clusters, with their distance. They come out in the order the chain
+ * finds them, which is not the order of increasing height.
+ */
+
+struct Merge {
+    int a, b;
+    double height;
+    bool operator<(const Merge& other) const { return height < other.height; }
+};
+
+std::vector<Merge> nn_chain(Packed d, int n, Linkage linkage) {
+    std::vector<int> next(n + 1), prev(n + 1);     // n is the list head
+    for (int i = 0; i <= n; i++) {
+        next[i] = (i + 1) % (n + 1);
+        prev[i] = (i + n) % (n + 1);
+    }
+    std::vector<double> size(n, 1.0);
+    std::vector<int> chain;
+    std::vector<Merge> merges;
+    merges.reserve(n - 1);
+
+    while ((int) merges.size() < n - 1) {
+        if (chain.empty()) chain.push_back(next[n]);
+        int a, b;
+        for (;;) {
+            a = chain.back();
+            const int c = chain.size() > 1 ? chain[chain.size() - 2] : -1;
+            double best = R_PosInf;
+            b = -1;
+            for (int k = next[n]; k != n; k = next[k]) {
+                if (k == a) continue;
+                const double dk = d(a, k);
+                if (dk < best) {
+                    best = dk;
+                    b = k;
+                }
+            }
+            if (c >= 0 && d(a, c) <= best) b = c;
+            if (b == c) break;
+            chain.push_back(b);
+        }
+        chain.pop_back();
+        chain.pop_back();
+
+        // merge a into b
+        const double dab = d(a, b), na = size[a], nb = size[b];
+        Merge m = { a, b, dab };
+        merges.push_back(m);
+        next[prev[a]] = next[a];
+        prev[next[a]] = prev[a];
+        for (int k = next[n]; k != n; k = next[k])
+            if (k != b) d(b, k) = lance_williams(linkage, d(a, k), d(b, k), dab, na, nb, size[k]);
+        size[b] = na + nb;
+    }
+    return merges;
+}
+
+/**
+ * A cluster which is merged keeps its id, so a step of the chain never
+ * refers to a cluster that no longer exists; the ids on the chain stay
+ * valid after a merge, as the reducibility argument above requires.
+ *
+ * ### Converting to hclust
+ *
+ * `hclust` objects list the merges in order of increasing height, in a
+ * two-column `merge` matrix where observation `i` is denoted `-i` and the
+ * cluster formed at step `s` is denoted `s`. The linkages here are
+ * monotone, so a cluster is always formed at a lower height than any
+ * merge that involves it; a stable sort by height therefore keeps every
+ * cluster before its uses, even among equal heights. A union-find
+ * structure then tells which cluster each recorded observation belonged to
+ * at the time. Within a row we follow the conventions of `hclust()`:
+ * observations before clusters, and the smaller number first among two
+ * observations or two clusters.
+ *
+ * The `order` of the leaves for plotting lists the observations of the
+ * first cluster of the final merge before those of the second,
+ * recursively, as `hclust()` does.
+ */
+
+int find(std::vector<int>& parent, int i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+List as_hclust(std::vector<Merge> merges, int n, bool sqrt_heights,
+               const std::string& method, const NumericVector& d) {
+    std::stable_sort(merges.begin(), merges.end());
+
+    IntegerMatrix merge(n - 1, 2);
+    NumericVector height(n - 1);
+    std::vector<int> parent(n), label(n);
+    for (int i = 0; i < n; i++) {
+        parent[i] = i;
+        label[i] = -(i + 1);
+    }
+    for (int s = 0; s < n - 1; s++) {
+        const int ra = find(parent, merges[s].a), rb = find(parent, merges[s].b);
+        int la = label[ra], lb = label[rb];
+        if ((la < 0) == (lb < 0) ? std::abs(la) > std::abs(lb) : la > 0) std::swap(la, lb);
+        merge(s, 0) = la;
+        merge(s, 1) = lb;
+        height[s] = sqrt_heights ? std::sqrt(merges[s].height) : merges[s].height;
+        parent[ra] = rb;
+        label[rb] = s + 1;
+    }
+
+    IntegerVector order(n);
+    std::vector<int> todo(1, n - 1);
+    for (int k = 0; !todo.empty(); ) {
+        const int node = todo.back();
+        todo.pop_back();
+        if (node < 0) {
+            order[k++] = -node;
+        } else {
+            todo.push_back(merge(node - 1, 1));
+            todo.push_back(merge(node - 1, 0));
+        }
+    }
+
+    List res = List::create(_["merge"] = merge, _["height"] = height, _["order"] = order,
+                            _["labels"] = d.attr("Labels"), _["method"] = method,
+                            _["dist.method"] = d.attr("method"));
+    res.attr("class") = "hclust";
+    return res;
+}
+
+/**
+ * ### The Function
+ *
+ * By default the function works on a copy of the distances. With
+ * `inplace = TRUE` it uses the memory of `d` itself and leaves it
+ * overwritten by intermediate cluster distances; that saves the copy, which
+ * for large `n` is the dominant memory cost, but is only safe when `d` is
+ * not used again, and not shared with another R variable.
+ */
+
+// [[Rcpp::export]]
+List nn_chain_hclust(NumericVector d, std::string method = "complete", bool inplace = false) {
+    if (!d.inherits("dist")) stop("d must be a dist object");
+    const int n = as<int>(d.attr("Size"));
+    if (n < 2) stop("need at least two observations");
+    for (R_xlen_t k = 0; k < d.size(); k++)
+        if (ISNAN(d[k])) stop("distances must not be missing");
+
+    Linkage linkage;
+    if (method == "single") linkage = SINGLE;
+    else if (method == "complete") linkage = COMPLETE;
+    else if (method == "average") linkage = AVERAGE;
+    else if (method == "ward.D" || method == "ward.D2") linkage = WARD;
+    else stop("method must be one of 'single', 'complete', 'average', 'ward.D' or 'ward.D2'");
+
+    NumericVector work = inplace ? d : clone(d);
+    const bool squared = method == "ward.D2";
+    if (squared)
+        for (R_xlen_t k = 0; k < work.size(); k++) work[k] *= work[k];
+
+    const std::vector<Merge> merges = nn_chain(Packed(work.begin(), n), n, linkage);
+    return as_hclust(merges, n, squared, method, d);
+}
+
+/**
+ * ### Comparison with hclust
+ *
+ * On data without tied distances, the results agree with `hclust()` in
+ * every component, up to rounding in the heights:
+ */
+
+/*** R
+set.seed(42)
+x <- matrix(rnorm(2000 * 10), ncol=10)
+rownames(x) <- paste0("obs", 1:2000)
+d <- dist(x)
+for (m in c("single", "complete", "average", "ward.D", "ward.D2")) {
+    h1 <- hclust(d, m)
+    h2 <- nn_chain_hclust(d, m)
+    stopifnot(identical(h1$merge, h2$merge),
+              all.equal(h1$height, h2$height),
+              identical(h1$order, h2$order),
+              identical(h1$labels, h2$labels))
+}
+*/
+
+/**
+ * The result is a regular `hclust` object, so `cutree()`, `plot()` and
+ * `as.dendrogram()` work with it as usual:
+ */
+
+/*** R
+h <- nn_chain_hclust(dist(USArrests), "average")
+table(cutree(h, k=4))
+plot(h, cex=0.6, main="USArrests, average linkage")
+*/
+
+/**
+ * ### Timing
+ *
+ * Both implementations need O(n^2) memory for the distances, and for these
+ * linkages `hclust()` also runs in roughly quadratic time, through a list
+ * of nearest neighbours which it updates after each merge. For 5,000
+ * observations:
+ */
+
+/*** R
+x <- matrix(rnorm(5000 * 10), ncol=10)
+d <- dist(x)
+library(rbenchmark)
+benchmark(hclust = hclust(d, "average"),
+          nn_chain = nn_chain_hclust(d, "average"),
+          order = "relative", replications = 3)[,1:4]
+*/
+
+/**
+ * The list of nearest neighbours in `hclust()` can need many updates after
+ * a merge, in the worst case making it cubic, while the chain is quadratic
+ * whatever the data. Where memory is the limit, `inplace = TRUE` also
+ * avoids the copy of the distances that `hclust()` always makes:
+ */
+
+/*** R
+h <- nn_chain_hclust(dist(x), "ward.D2", inplace=TRUE)
+*/
@@ -0,0 +1,299 @@
+/**
+ * @title Rolling Covariance and Correlation Matrices via Rank-One Updates
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags parallel matrix modeling
+ * @summary Computes covariance or correlation matrices over a sliding window
+ *   by adding and removing one observation at a time, in parallel over the
+ *   entries of the p x p matrix.
+ *
+ * Both the [Gerber statistic](https://gallery.rcpp.org/articles/gerber-statistic)
+ * and the [hierarchical risk
+ * parity](https://gallery.rcpp.org/articles/hierarchical-risk-parity) articles
+ * compute a full correlation matrix from a lookback window of returns (the
+ * `LOOKBACK` argument of `GERBER_CORRELATION`). In a backtest that window
+ * slides forward one day at a time, and recomputing every matrix from scratch
+ * costs O(n p<sup>2</sup>) per window, or O(T n p<sup>2</sup>) for T windows of
+ * length n over p assets.
+ *
+ * Consecutive windows share all but two observations, so we can do much
+ * better: drop the oldest row, add the newest, and update the matrix of
+ * centred cross-products with two rank-one corrections. Each window then costs
+ * O(p<sup>2</sup>) no matter how long the lookback is.
+ */
+
+/**
+ * ### Adding and Removing One Observation
+ *
+ * Let `m` be the mean and `C` the matrix of centred cross-products (the
+ * co-moment, so that the covariance is `C / (n - 1)`) of a window with `n`
+ * rows. Welford's update for adding a row `x` to a window of `n - 1` rows
+ * with mean `m'` is
+ *
+ * `C = C' + (n - 1) / n * (x - m') (x - m')'`
+ *
+ * and solving it for `C'` gives the downdate that removes `x` from a window of
+ * `n` rows with mean `m`:
+ *
+ * `C' = C - n / (n - 1) * (x - m) (x - m)'`
+ *
+ * Sliding the window is a downdate of the oldest row followed by an update
+ * with the newest one. Both corrections are symmetric, so every entry
+ * `C(i, j)` evolves independently of all the others once the window means are
+ * known. That is what makes the computation easy to parallelise: we compute
+ * the rolling means first, and then hand out blocks of entries of the p x p
+ * matrix to the worker threads, each of which walks its entries through all
+ * the windows without any synchronisation.
+ *
+ * Subtracting rank-one terms accumulates rounding error over long series, so
+ * every `refresh` windows the entry is recomputed exactly with a two-pass
+ * formula. This bounds the drift at the cost of O(n) every `refresh` steps.
+ */
+
+// [[Rcpp::plugins(cpp11)]]
+#include <Rcpp.h>
+// [[Rcpp::depends(RcppParallel)]]
+#include <RcppParallel.h>
+using namespace Rcpp;
+using namespace RcppParallel;
+
+#include <cmath>
+#include <vector>
+
+// exact centred cross-product of columns i and j over rows [start, start + n)
+inline double comoment_exact(const RMatrix<double>& x, const RMatrix<double>& means,
+                             std::size_t t, std::size_t n,
+                             std::size_t i, std::size_t j) {
+    double mi = means(t, i), mj = means(t, j), c = 0.0;
+    for (std::size_t r = t; r < t + n; r++)
+        c += (x(r, i) - mi) * (x(r, j) - mj);
+    return c;
+}
+
+// walk the co-moment of columns (i, j) through all windows, calling
+// out(t, value) for each window t
+template <typename Output>
+inline void comoment_path(const RMatrix<double>& x, const RMatrix<double>& means,
+                          std::size_t n, std::size_t refresh,
+                          std::size_t i, std::size_t j, Output out) {
+    const std::size_t nwin = means.nrow();
+    const double down = n / (n - 1.0), up = (n - 1.0) / n;
+    double c = comoment_exact(x, means, 0, n, i, j);
+    out(0, c);
+    for (std::size_t t = 1; t < nwin; t++) {
+        if (refresh > 0 && t % refresh == 0) {
+            c = comoment_exact(x, means, t, n, i, j);
+        } else {
+            // remove row t - 1 from the window ending at t + n - 2 ...
+            double oi = x(t - 1, i), oj = x(t - 1, j);
+            double mi = means(t - 1, i), mj = means(t - 1, j);
+            c -= down * (oi - mi) * (oj - mj);
+            // ... and add row t + n - 1 to the remaining n - 1 rows
+            double pi = (n * mi - oi) / (n - 1.0), pj = (n * mj - oj) / (n - 1.0);
+            c += up * (x(t + n - 1, i) - pi) * (x(t + n - 1, j) - pj);
+        }
+        out(t, c);
+    }
+}
+
+/**
+ * The rolling means are themselves computed with a running sum, which is
+ * refreshed on the same schedule as the co-moments:
+ */
+
+struct RollingMeans : public Worker {
+    const RMatrix<double> x;
+    const std::size_t n, refresh;
+    RMatrix<double> means;
+
+    RollingMeans(const NumericMatrix x, std::size_t n, std::size_t refresh,
+                 NumericMatrix means)
+        : x(x), n(n), refresh(refresh), means(means) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        const std::size_t nwin = means.nrow();
+        for (std::size_t i = begin; i < end; i++) {
+            double s = 0.0;
+            for (std::size_t t = 0; t < nwin; t++) {
+                if (t == 0 || (refresh > 0 && t % refresh == 0)) {
+                    s = 0.0;
+                    for (std::size_t r = t; r < t + n; r++) s += x(r, i);
+                } else {
+                    s += x(t + n - 1, i) - x(t - 1, i);
+                }
+                means(t, i) = s / n;
+            }
+        }
+    }
+};
+
+/**
+ * The variances are the diagonal of the co-moment matrix. They are computed
+ * in a first parallel pass, because every correlation needs the two variances
+ * of its row and column, and those generally belong to another worker's block.
+ */
+
+struct RollingVariances : public Worker {
+    const RMatrix<double> x, means;
+    const std::size_t n, refresh;
+    RMatrix<double> vars;
+
+    RollingVariances(const NumericMatrix x, const NumericMatrix means,
+                     std::size_t n, std::size_t refresh, NumericMatrix vars)
+        : x(x), means(means), n(n), refresh(refresh), vars(vars) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            RMatrix<double>& v = vars;
+            double denom = n - 1.0;
+            comoment_path(x, means, n, refresh, i, i,
+                          [&](std::size_t t, double c) { v(t, i) = c / denom; });
+        }
+    }
+};
+
+/**
+ * The main worker processes a range of entries. The output has one row per
+ * window and one column per entry, so that each entry's path through time is
+ * written to contiguous memory. Entries are enumerated either over the full
+ * p x p matrix in column-major order, or over the lower triangle (including
+ * the diagonal) in the column-major order used by `lower.tri()`; the lookup
+ * tables `row` and `col` map an entry index to its matrix position.
+ */
+
+struct RollingComoments : public Worker {
+    const RMatrix<double> x, means, vars;
+    const RVector<int> row, col;
+    const std::size_t n, refresh;
+    const bool correlation;
+    RMatrix<double> out;
+
+    RollingComoments(const NumericMatrix x, const NumericMatrix means,
+                     const NumericMatrix vars, const IntegerVector row,
+                     const IntegerVector col, std::size_t n, std::size_t refresh,
+                     bool correlation, NumericMatrix out)
+        : x(x), means(means), vars(vars), row(row), col(col), n(n),
+          refresh(refresh), correlation(correlation), out(out) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t k = begin; k < end; k++) {
+            std::size_t i = row[k], j = col[k];
+            RMatrix<double>::Column o = out.column(k);
+            if (i == j) {
+                // the diagonal was computed by RollingVariances
+                for (std::size_t t = 0; t < o.length(); t++)
+                    o[t] = correlation ? 1.0 : vars(t, i);
+                continue;
+            }
+            const RMatrix<double>& v = vars;
+            const bool cor = correlation;
+            const double denom = n - 1.0;
+            comoment_path(x, means, n, refresh, i, j,
+                          [&](std::size_t t, double c) {
+                              double cov = c / denom;
+                              o[t] = cor ? cov / std::sqrt(v(t, i) * v(t, j)) : cov;
+                          });
+        }
+    }
+};
+
+/**
+ * The exported function ties the three passes together. Setting `lower =
+ * TRUE` roughly halves both the work and the size of the result; the full
+ * matrix for window `t` can be recovered in R by filling the lower triangle
+ * and mirroring it.
+ */
+
+// [[Rcpp::export]]
+NumericMatrix rollingCov(NumericMatrix x, int window, bool correlation = false,
+                         bool lower = false, int refresh = 250) {
+    const int T = x.nrow(), p = x.ncol();
+    if (window < 2 || window > T)
+        stop("'window' must be between 2 and nrow(x)");
+    if (refresh < 0)
+        stop("'refresh' must be non-negative (0 disables exact recomputation)");
+    const int nwin = T - window + 1;
+
+    NumericMatrix means(nwin, p), vars(nwin, p);
+    RollingMeans rollingMeans(x, window, refresh, means);
+    parallelFor(0, p, rollingMeans);
+    RollingVariances rollingVariances(x, means, window, refresh, vars);
+    parallelFor(0, p, rollingVariances);
+
+    // enumerate the entries to compute
+    std::vector<int> ri, ci;
+    for (int j = 0; j < p; j++)
+        for (int i = lower ? j : 0; i < p; i++) {
+            ri.push_back(i);
+            ci.push_back(j);
+        }
+    IntegerVector row = wrap(ri), col = wrap(ci);
+
+    NumericMatrix out(nwin, row.size());
+    RollingComoments rollingComoments(x, means, vars, row, col, window, refresh,
+                                      correlation, out);
+    // a grain size keeps each task busy with a block of entries
+    parallelFor(0, row.size(), rollingComoments, 64);
+    return out;
+}
+
+/**
+ * ### Checking the Result
+ *
+ * We compare against `cov()` and `cor()` evaluated on every window directly:
+ */
+
+/*** R
+set.seed(42)
+nobs <- 2500
+nassets <- 30
+lookback <- 480
+R <- matrix(rnorm(nobs * nassets, sd = 0.01), nobs, nassets)
+
+naive <- function(R, lookback, f) {
+    t(sapply(seq_len(nrow(R) - lookback + 1), function(t)
+        as.vector(f(R[t:(t + lookback - 1), ]))))
+}
+
+stopifnot(all.equal(rollingCov(R, lookback), naive(R, lookback, cov)))
+stopifnot(all.equal(rollingCov(R, lookback, correlation = TRUE),
+                    naive(R, lookback, cor)))
+
+# the lower-triangle layout matches lower.tri(..., diag = TRUE)
+low <- rollingCov(R, lookback, correlation = TRUE, lower = TRUE)
+full <- naive(R, lookback, cor)
+keep <- which(lower.tri(diag(nassets), diag = TRUE))
+stopifnot(all.equal(low, full[, keep]))
+
+# correlation matrix for the last window
+C <- matrix(0, nassets, nassets)
+C[keep] <- low[nrow(low), ]
+C[upper.tri(C)] <- t(C)[upper.tri(C)]
+stopifnot(all.equal(C, cor(tail(R, lookback))))
+*/
+
+/**
+ * ### Benchmark
+ *
+ * The rolling version no longer depends on the lookback length, while the
+ * naive version grows linearly with it:
+ */
+
+/*** R
+library(rbenchmark)
+benchmark(naive(R, lookback, cor),
+          rollingCov(R, lookback, correlation = TRUE),
+          rollingCov(R, lookback, correlation = TRUE, lower = TRUE),
+          replications = 5, order = "relative")[,1:4]
+*/
+
+/**
+ * With `refresh = 0` the exact recomputation is switched off entirely. For
+ * returns data the drift stays well below `1e-12` over tens of thousands of
+ * windows, but series with a large mean relative to their spread (prices
+ * rather than returns, say) lose precision much faster, and the default of
+ * one exact pass per year of daily data is a cheap safeguard.
+ *
+ * You can learn more about using RcppParallel at
+ * [https://rcppcore.github.com/RcppParallel](https://rcppcore.github.com/RcppParallel).
+ */
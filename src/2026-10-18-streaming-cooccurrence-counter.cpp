@@ -0,0 +1,556 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title A Streaming Term Co-occurrence Counter with External Sorting
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags sparse parallel modules
+ * @summary Counts windowed, distance-weighted term co-occurrences over a
+ *   stream of token chunks in bounded memory, using threads that own shards
+ *   of the rows, sorted runs spilled to disk, and a final merge into a
+ *   dgCMatrix.
+ *
+ * GloVe word embeddings, as in the article on [fast asynchronous SGD with
+ * RcppParallel](https://gallery.rcpp.org/articles/rcpp-sgd), are fitted to
+ * a term co-occurrence matrix: entry `(i, j)` sums `1 / offset` over all
+ * occurrences of terms `i` and `j` at most `window` tokens apart. The
+ * article builds it in an in-memory hash map, which limits the corpus to
+ * what fits in memory together with the map.
+ *
+ * For larger corpora the usual answer is external sorting, as in the
+ * reference GloVe implementation. The counter below
+ *
+ * - consumes the corpus as a sequence of chunks of integer token ids, which
+ *   R can read from disk piece by piece,
+ * - accumulates weights in fixed-size hash tables, one per *shard* of the
+ *   rows, each shard being updated by exactly one thread, so that no locks
+ *   are needed,
+ * - when a shard's table fills up, sorts its contents and writes them to a
+ *   temporary file as a *sorted run*, and
+ * - at the end merges each shard's runs, summing equal entries, and
+ *   assembles the `dgCMatrix`.
+ *
+ * Memory use is therefore bounded by the size of the tables, set by the
+ * caller, plus the final matrix.
+ */
+
+// [[Rcpp::depends(RcppParallel)]]
+// [[Rcpp::plugins(cpp11)]]
+#include <Rcpp.h>
+#include <RcppParallel.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace Rcpp;
+using namespace RcppParallel;
+
+/**
+ * ### Entries and Shards
+ *
+ * As in the GloVe article, the matrix is symmetric and only its upper
+ * triangle is stored: a pair of terms `u, v` contributes to row `min(u, v)`
+ * and column `max(u, v)`. An entry is the packed key `col * vocab + row`,
+ * whose order is the column-major order of the result, plus its weight.
+ *
+ * The row determines the shard, through a multiplicative hash so that
+ * frequent terms (which have small ids after the usual sorting of a
+ * vocabulary) spread evenly over the shards.
+ */
+
+typedef std::uint64_t Key;
+const Key EMPTY = ~Key(0);
+
+struct Entry {
+    Key key;
+    double x;
+    bool operator<(const Entry& other) const { return key < other.key; }
+};
+
+inline std::size_t shard_of(int row, std::size_t nshards) {
+    const std::uint32_t h = (std::uint32_t) row * 2654435761u;
+    return ((std::uint64_t) h * nshards) >> 32;
+}
+
+/**
+ * ### Sorted Runs
+ *
+ * A run is a plain binary file of `Entry` records in key order; it is only
+ * ever read back by the same process. A reader buffers 4096 entries at a
+ * time, and can also stand in for a run that is still in memory.
+ *
+ * Runs are combined by a k-way merge with a heap over their heads, which
+ * sums equal keys from different runs as they come out and passes each
+ * distinct entry to a sink.
+ */
+
+class RunReader {
+public:
+    explicit RunReader(const std::string& path) : f(std::fopen(path.c_str(), "rb")), pos(0) {
+        if (!f) throw std::runtime_error("cannot open " + path);
+    }
+    explicit RunReader(std::vector<Entry>& entries) : f(NULL), pos(0) { buf.swap(entries); }
+    ~RunReader() { if (f) std::fclose(f); }
+
+    bool empty() {
+        if (pos < buf.size()) return false;
+        if (!f) return true;
+        buf.resize(1 << 12);
+        buf.resize(std::fread(buf.data(), sizeof(Entry), buf.size(), f));
+        pos = 0;
+        return buf.empty();
+    }
+    const Entry& head() const { return buf[pos]; }
+    void pop() { pos++; }
+
+private:
+    RunReader(const RunReader&);
+    std::FILE* f;
+    std::vector<Entry> buf;
+    std::size_t pos;
+};
+
+template <class Sink>
+void merge_runs(std::vector<std::unique_ptr<RunReader> >& runs, Sink sink) {
+    typedef std::pair<Key, std::size_t> Head;     // smallest key on top
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heap;
+    for (std::size_t r = 0; r < runs.size(); r++)
+        if (!runs[r]->empty()) heap.push(Head(runs[r]->head().key, r));
+
+    Entry cur = { EMPTY, 0.0 };
+    while (!heap.empty()) {
+        const std::size_t r = heap.top().second;
+        heap.pop();
+        const Entry& e = runs[r]->head();
+        if (e.key == cur.key) {
+            cur.x += e.x;
+        } else {
+            if (cur.key != EMPTY) sink(cur);
+            cur = e;
+        }
+        runs[r]->pop();
+        if (!runs[r]->empty()) heap.push(Head(runs[r]->head().key, r));
+    }
+    if (cur.key != EMPTY) sink(cur);
+}
+
+/**
+ * ### Fixed-size Tables
+ *
+ * Each shard accumulates into an open-addressing hash table of fixed
+ * capacity. Once it is 70 per cent full, its entries are sorted and written
+ * out as a run, and the table is cleared. To keep the number of files (and
+ * of buffers open during the final merge) bounded, a shard which has
+ * accumulated 32 runs merges them into one, so that the total number of
+ * runs grows only logarithmically with the size of the corpus.
+ */
+
+const std::size_t MAX_RUNS = 32;
+
+class ShardTable {
+public:
+    ShardTable(std::size_t capacity, const std::string& prefix)
+        : keys(capacity, EMPTY), vals(capacity), mask(capacity - 1), n(0),
+          limit(capacity * 7 / 10), prefix(prefix), nfiles(0) {}
+
+    ~ShardTable() {
+        for (std::size_t r = 0; r < runs.size(); r++) std::remove(runs[r].c_str());
+    }
+
+    void add(Key key, double x) {
+        std::size_t h = (key * 0x9E3779B97F4A7C15ull) >> 20 & mask;
+        while (keys[h] != EMPTY && keys[h] != key) h = (h + 1) & mask;
+        if (keys[h] == EMPTY) {
+            keys[h] = key;
+            vals[h] = x;
+            if (++n >= limit) spill();
+        } else {
+            vals[h] += x;
+        }
+    }
+
+    // the current contents in key order; clears the table
+    std::vector<Entry> drain() {
+        std::vector<Entry> out;
+        out.reserve(n);
+        for (std::size_t h = 0; h < keys.size(); h++)
+            if (keys[h] != EMPTY) {
+                Entry e = { keys[h], vals[h] };
+                out.push_back(e);
+                keys[h] = EMPTY;
+            }
+        n = 0;
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    void spill() {
+        std::vector<Entry> out = drain();
+        Writer w(next_file());
+        w.write(out.data(), out.size());
+        runs.push_back(w.close());
+        if (runs.size() >= MAX_RUNS) compact();
+    }
+
+    std::vector<std::string> runs;
+    std::string error;
+
+private:
+    class Writer {
+    public:
+        explicit Writer(const std::string& path) : path(path), f(std::fopen(path.c_str(), "wb")) {
+            if (!f) throw std::runtime_error("cannot create " + path);
+        }
+        ~Writer() { if (f) std::fclose(f); }
+        void write(const Entry* e, std::size_t n) {
+            if (std::fwrite(e, sizeof(Entry), n, f) != n)
+                throw std::runtime_error("cannot write " + path);
+        }
+        std::string close() {
+            const int status = std::fclose(f);
+            f = NULL;
+            if (status != 0) throw std::runtime_error("cannot write " + path);
+            return path;
+        }
+    private:
+        std::string path;
+        std::FILE* f;
+    };
+
+    std::string next_file() { return prefix + std::to_string(nfiles++) + ".bin"; }
+
+    void compact() {
+        std::vector<std::unique_ptr<RunReader> > in;
+        for (std::size_t r = 0; r < runs.size(); r++)
+            in.emplace_back(new RunReader(runs[r]));
+        Writer w(next_file());
+        merge_runs(in, [&w](const Entry& e) { w.write(&e, 1); });
+        const std::string merged = w.close();
+        in.clear();
+        for (std::size_t r = 0; r < runs.size(); r++) std::remove(runs[r].c_str());
+        runs.assign(1, merged);
+    }
+
+    std::vector<Key> keys;
+    std::vector<double> vals;
+    std::size_t mask, n, limit;
+    std::string prefix;
+    int nfiles;
+};
+
+/**
+ * The writes of a compaction go through the `FILE` buffer, so writing one
+ * entry at a time is cheap.
+ *
+ * ### Counting a Chunk
+ *
+ * All threads scan the whole chunk, and each keeps only the pairs whose row
+ * falls into its shards. Scanning is cheap compared with a hash table
+ * update, and this way every table has a single writer.
+ *
+ * A window can straddle two chunks. The counter therefore keeps the last
+ * `window` tokens of the previous chunk and prepends them to the next one,
+ * counting only the pairs which involve at least one new token. Between
+ * documents the carried tokens are dropped, so that no window spans two
+ * documents.
+ */
+
+struct CountChunk : public Worker {
+    const std::vector<int>& seq;
+    const std::size_t carried;
+    const int window, vocab;
+    std::vector<std::unique_ptr<ShardTable> >& shards;
+
+    CountChunk(const std::vector<int>& seq, std::size_t carried, int window, int vocab,
+               std::vector<std::unique_ptr<ShardTable> >& shards)
+        : seq(seq), carried(carried), window(window), vocab(vocab), shards(shards) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        const std::size_t n = seq.size();
+        for (std::size_t s = begin; s < end; s++) {
+            ShardTable& table = *shards[s];
+            try {
+                for (std::size_t t = 0; t < n; t++) {
+                    // pairs (t, t + off) with t + off >= carried are new
+                    const int first = t >= carried ? 1 : (int) (carried - t);
+                    for (int off = first; off <= window && t + off < n; off++) {
+                        const int u = seq[t], v = seq[t + off];
+                        const int row = std::min(u, v), col = std::max(u, v);
+                        if (shard_of(row, shards.size()) != s) continue;
+                        table.add((Key) col * vocab + row, 1.0 / off);
+                    }
+                }
+            } catch (std::exception& e) {
+                table.error = e.what();
+            }
+        }
+    }
+};
+
+/**
+ * ### Merging the Shards
+ *
+ * At the end, each shard merges its runs with whatever is still in its
+ * table. The shards are merged in parallel, each into its own vector.
+ */
+
+struct MergeRuns : public Worker {
+    std::vector<std::unique_ptr<ShardTable> >& shards;
+    std::vector<std::vector<Entry> >& merged;
+
+    MergeRuns(std::vector<std::unique_ptr<ShardTable> >& shards,
+              std::vector<std::vector<Entry> >& merged)
+        : shards(shards), merged(merged) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t s = begin; s < end; s++) {
+            try {
+                ShardTable& table = *shards[s];
+                std::vector<Entry> last = table.drain();
+                std::vector<std::unique_ptr<RunReader> > runs;
+                for (std::size_t r = 0; r < table.runs.size(); r++)
+                    runs.emplace_back(new RunReader(table.runs[r]));
+                runs.emplace_back(new RunReader(last));
+                std::vector<Entry>& out = merged[s];
+                merge_runs(runs, [&out](const Entry& e) { out.push_back(e); });
+            } catch (std::exception& e) {
+                shards[s]->error = e.what();
+            }
+        }
+    }
+};
+
+/**
+ * ### Assembling the Matrix
+ *
+ * The merged shards are sorted by key, but the rows of a column are spread
+ * over all shards. We count the entries of every column in every shard,
+ * which gives each shard its place within each column, let the shards
+ * scatter in parallel, and then sort the (short) columns by row, in
+ * parallel over columns.
+ */
+
+struct ScatterShards : public Worker {
+    const std::vector<std::vector<Entry> >& merged;
+    std::vector<int>& offset;       // nshards x vocab
+    const int vocab;
+    RVector<int> i;
+    RVector<double> x;
+
+    ScatterShards(const std::vector<std::vector<Entry> >& merged, std::vector<int>& offset,
+                  int vocab, IntegerVector i, NumericVector x)
+        : merged(merged), offset(offset), vocab(vocab), i(i), x(x) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t s = begin; s < end; s++) {
+            int* next = &offset[s * vocab];
+            for (std::size_t k = 0; k < merged[s].size(); k++) {
+                const Entry& e = merged[s][k];
+                const int pos = next[e.key / vocab]++;
+                i[pos] = e.key % vocab;
+                x[pos] = e.x;
+            }
+        }
+    }
+};
+
+struct SortColumns : public Worker {
+    const RVector<int> p;
+    RVector<int> i;
+    RVector<double> x;
+
+    SortColumns(IntegerVector p, IntegerVector i, NumericVector x) : p(p), i(i), x(x) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        std::vector<std::pair<int, double> > col;
+        for (std::size_t j = begin; j < end; j++) {
+            col.clear();
+            for (int k = p[j]; k < p[j + 1]; k++) col.push_back(std::make_pair(i[k], x[k]));
+            std::sort(col.begin(), col.end());
+            for (std::size_t t = 0; t < col.size(); t++) {
+                i[p[j] + t] = col[t].first;
+                x[p[j] + t] = col[t].second;
+            }
+        }
+    }
+};
+
+/**
+ * ### The Counter Class
+ *
+ * The counter lives in R as an Rcpp module object, so that it can be fed
+ * chunk by chunk from an R loop. `memory_mb` bounds the hash tables of all
+ * shards together, at sixteen bytes per slot; spilled runs go to files
+ * in `tmpdir`, named by R's `tempfile()`, and are removed when the counter
+ * is finalised. Token ids are one-based, as they come out of `match()`
+ * against a vocabulary.
+ */
+
+class CooccurrenceCounter {
+public:
+    CooccurrenceCounter(int vocab, int window, int nshards, double memory_mb,
+                        std::string tmpdir)
+        : vocab(vocab), window(window) {
+        if (vocab < 1 || window < 1 || nshards < 1) stop("invalid arguments");
+        std::size_t capacity = 1024;
+        while (2 * capacity * 16 * nshards <= memory_mb * (1 << 20)) capacity *= 2;
+        // a fresh name from R, so that other counters and other R processes
+        // sharing the directory do not write to the same files
+        Function tempfile("tempfile");
+        const std::string base = as<std::string>(tempfile("cooc", tmpdir)) + "_";
+        for (int s = 0; s < nshards; s++)
+            shards.emplace_back(new ShardTable(capacity, base + std::to_string(s) + "_"));
+    }
+
+    void add_chunk(IntegerVector tokens) {
+        for (R_xlen_t k = 0; k < tokens.size(); k++)
+            if (tokens[k] < 1 || tokens[k] > vocab) stop("token id out of range");
+        const std::size_t carried = tail.size();
+        std::vector<int> seq(tail);
+        for (R_xlen_t k = 0; k < tokens.size(); k++) seq.push_back(tokens[k] - 1);
+
+        CountChunk counter(seq, carried, window, vocab, shards);
+        parallelFor(0, shards.size(), counter, 1);
+        check_errors();
+
+        const std::size_t keep = std::min<std::size_t>(window, seq.size());
+        tail.assign(seq.end() - keep, seq.end());
+    }
+
+    void end_document() { tail.clear(); }
+
+    int nruns() const {
+        std::size_t n = 0;
+        for (std::size_t s = 0; s < shards.size(); s++) n += shards[s]->runs.size();
+        return n;
+    }
+
+    // merge everything counted so far; the counter is empty afterwards
+    S4 result() {
+        const std::size_t nshards = shards.size();
+        std::vector<std::vector<Entry> > merged(nshards);
+        MergeRuns merger(shards, merged);
+        parallelFor(0, nshards, merger, 1);
+        check_errors();
+        for (std::size_t s = 0; s < nshards; s++) {
+            for (std::size_t r = 0; r < shards[s]->runs.size(); r++)
+                std::remove(shards[s]->runs[r].c_str());
+            shards[s]->runs.clear();
+        }
+        tail.clear();
+
+        std::size_t total = 0;
+        for (std::size_t s = 0; s < nshards; s++) total += merged[s].size();
+        if (total > (std::size_t) std::numeric_limits<int>::max())
+            stop("too many distinct pairs for a dgCMatrix");
+
+        std::vector<int> offset(nshards * vocab, 0);
+        for (std::size_t s = 0; s < nshards; s++)
+            for (std::size_t k = 0; k < merged[s].size(); k++)
+                offset[s * vocab + merged[s][k].key / vocab]++;
+        IntegerVector p(vocab + 1);
+        for (int j = 0; j < vocab; j++) {
+            int pos = p[j];
+            for (std::size_t s = 0; s < nshards; s++) {
+                const int c = offset[s * vocab + j];
+                offset[s * vocab + j] = pos;
+                pos += c;
+            }
+            p[j + 1] = pos;
+        }
+
+        IntegerVector i(p[vocab]);
+        NumericVector x(p[vocab]);
+        ScatterShards scatter(merged, offset, vocab, i, x);
+        parallelFor(0, nshards, scatter, 1);
+        SortColumns sorter(p, i, x);
+        parallelFor(0, vocab, sorter, 256);
+
+        S4 res("dgCMatrix");
+        res.slot("p") = p;
+        res.slot("i") = i;
+        res.slot("x") = x;
+        res.slot("Dim") = IntegerVector::create(vocab, vocab);
+        return res;
+    }
+
+private:
+    void check_errors() {
+        for (std::size_t s = 0; s < shards.size(); s++)
+            if (!shards[s]->error.empty()) {
+                std::string msg = shards[s]->error;
+                shards[s]->error.clear();
+                stop(msg);
+            }
+    }
+
+    int vocab, window;
+    std::vector<std::unique_ptr<ShardTable> > shards;
+    std::vector<int> tail;
+};
+
+RCPP_MODULE(cooccurrence) {
+    class_<CooccurrenceCounter>("CooccurrenceCounter")
+    .constructor<int, int, int, double, std::string>()
+    .method("add_chunk", &CooccurrenceCounter::add_chunk)
+    .method("end_document", &CooccurrenceCounter::end_document)
+    .method("result", &CooccurrenceCounter::result)
+    .property("nruns", &CooccurrenceCounter::nruns)
+    ;
+}
+
+/**
+ * The offsets for the scatter take `nshards * vocab` integers, which is
+ * small next to the matrix for any realistic vocabulary.
+ *
+ * ### Checking
+ *
+ * We feed a synthetic corpus in chunks of 100,000 tokens, with a memory
+ * budget small enough to force many spills, and compare with a direct
+ * computation in R, which handles one offset at a time:
+ */
+
+/*** R
+suppressMessages(library(Matrix))
+set.seed(42)
+vocab <- 10000L
+window <- 5L
+tokens <- sample(vocab, 2e6, replace = TRUE, prob = 1 / seq_len(vocab))
+
+tcm_r <- function(tokens, vocab, window) {
+    n <- length(tokens)
+    res <- sparseMatrix(i = integer(0), j = integer(0), x = numeric(0), dims = c(vocab, vocab))
+    for (off in seq_len(window)) {
+        u <- tokens[1:(n - off)]
+        v <- tokens[(1 + off):n]
+        res <- res + sparseMatrix(i = pmin(u, v), j = pmax(u, v), x = 1 / off,
+                                  dims = c(vocab, vocab))
+    }
+    res
+}
+
+counter <- new(CooccurrenceCounter, vocab, window, 4L, 8, tempdir())
+for (chunk in split(tokens, ceiling(seq_along(tokens) / 1e5)))
+    counter$add_chunk(chunk)
+counter$nruns
+tcm <- counter$result()
+stopifnot(all.equal(tcm, tcm_r(tokens, vocab, window), check.attributes = FALSE))
+*/
+
+/**
+ * With eight megabytes for four shards, the tables hold 2^17 slots each, so
+ * every shard spills many times over the two million tokens (and compacts
+ * its runs along the way), and the merge reassembles the same matrix as the
+ * direct computation. In
+ * practice the budget would be set to most of the available memory, so
+ * that only very large corpora spill at all, and the chunks would be read
+ * from disk; calling `end_document()` between files keeps windows from
+ * spanning them.
+ */
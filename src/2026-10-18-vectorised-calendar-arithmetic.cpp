@@ -0,0 +1,508 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Vectorised Calendar Arithmetic on Date Vectors
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags date benchmark
+ * @summary Computes IMM dates, nth weekdays, month ends, business day rolls
+ *   and day count fractions for whole Date vectors with integer civil
+ *   calendar arithmetic, without creating a date object per element.
+ *
+ * Two early gallery articles compute calendar dates with Boost Date_Time:
+ * [using Boost via BH](https://gallery.rcpp.org/articles/using-boost-with-bh)
+ * finds the [IMM date](http://en.wikipedia.org/wiki/IMM_dates), the third
+ * Wednesday of a month, and the [custom as and wrap
+ * example](https://gallery.rcpp.org/articles/custom-as-and-wrap-example)
+ * finds the first given weekday after a date. Both take a single date,
+ * build a `boost::gregorian::date` from it, let a date generator step
+ * through the calendar one day at a time, and convert the result back
+ * through an `Rcpp::Date`. That is fine for one date. Generating the
+ * payment schedules of a large book of trades needs millions of such dates,
+ * however, and then the objects, the day-by-day loops and the calls from R
+ * for every single date add up.
+ *
+ * An R `Date` is simply a count of days since January 1, 1970. Every
+ * question about the calendar can be answered from that count with a few
+ * integer operations: the weekday is the count modulo seven, and year,
+ * month and day follow from Howard Hinnant's [civil date
+ * algorithms](https://howardhinnant.github.io/date_algorithms.html), which
+ * convert in either direction without tables or loops. Here we build a
+ * small set of vectorised kernels on them, which take and return whole
+ * `Date` vectors.
+ */
+
+// [[Rcpp::plugins(cpp11)]]
+#include <Rcpp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using namespace Rcpp;
+
+/**
+ * ### Civil Dates
+ *
+ * `days_from_civil()` turns a year, month and day into a day count, and
+ * `civil_from_days()` does the reverse. Both shift the start of the year to
+ * March, so that the leap day is the last day of a year, and then count in
+ * 400-year eras, which repeat exactly. Weekdays are numbered from Sunday as
+ * 0 to Saturday as 6, as in Boost and in `as.POSIXlt()$wday`; January 1,
+ * 1970 was a Thursday.
+ */
+
+namespace cal {
+
+inline int days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int>(doe) - 719468;
+}
+
+struct Civil {
+    int year, month, day;
+};
+
+inline Civil civil_from_days(int z) {
+    z += 719468;
+    const int era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    const int d = doy - (153 * mp + 2) / 5 + 1;
+    const int m = mp < 10 ? mp + 3 : mp - 9;
+    Civil c = { static_cast<int>(yoe) + era * 400 + (m <= 2), m, d };
+    return c;
+}
+
+inline int weekday(int z) {
+    return z >= -4 ? (z + 4) % 7 : (z + 5) % 7 + 6;
+}
+
+inline bool is_leap(int y) {
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+inline int days_in_month(int y, int m) {
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    return m == 2 && is_leap(y) ? 29 : days[m - 1];
+}
+
+/**
+ * With these, the date generators of Boost become closed formulas. The
+ * first weekday `wd` of a month is the first of the month plus however many
+ * days it takes to reach `wd`, and the nth one is whole weeks later. Like
+ * Boost's `nth_day_of_the_week_in_month`, asking for a fifth weekday in a
+ * month which has only four gives the last one. The first weekday strictly
+ * after a date is found the same way, starting from the next day.
+ */
+
+inline int nth_weekday(int nth, int wd, int month, int year) {
+    const int first = days_from_civil(year, month, 1);
+    int d = first + (wd - weekday(first) + 7) % 7 + 7 * (nth - 1);
+    if (d - first >= days_in_month(year, month)) d -= 7;
+    return d;
+}
+
+inline int first_weekday_after(int wd, int z) {
+    return z + 1 + (wd - weekday(z + 1) + 7) % 7;
+}
+
+inline int month_end(int z) {
+    const Civil c = civil_from_days(z);
+    return z + days_in_month(c.year, c.month) - c.day;
+}
+
+}
+
+/**
+ * ### Vectors In and Out
+ *
+ * The kernels accept `Date` vectors, which R stores as doubles, and
+ * arguments such as months or weekdays as integers. Shorter arguments are
+ * recycled, as in R arithmetic. Missing values, and arguments outside their
+ * valid range such as a month of 13, give `NA`. Dates and years are
+ * limited to a few hundred thousand years either side of 1970, so that the
+ * day counts never overflow an `int`. Results are plain numeric vectors
+ * with the class `Date` set, so no `Rcpp::Date` is ever created.
+ */
+
+inline R_xlen_t recycled_length(R_xlen_t a, R_xlen_t b) {
+    return a == 0 || b == 0 ? 0 : std::max(a, b);
+}
+
+inline bool is_day(double x) { return !ISNAN(x) && std::fabs(x) < 1e8; }
+
+inline bool is_year(int y) { return y != NA_INTEGER && y > -200000 && y < 200000; }
+
+inline NumericVector as_dates(NumericVector x) {
+    x.attr("class") = "Date";
+    return x;
+}
+
+/**
+ * ### IMM Dates and Weekdays
+ *
+ * The vectorised `getIMMDates()` computes the third Wednesday for vectors
+ * of months and years, and `nthWeekdayOfMonth()` any nth weekday.
+ * `nextIMMDates()` gives the first IMM date of the quarterly cycle
+ * (March, June, September, December) strictly after each date, which is
+ * how the maturity of the front futures contract is usually found.
+ */
+
+// [[Rcpp::export]]
+NumericVector nthWeekdayOfMonth(IntegerVector nth, IntegerVector weekday,
+                                IntegerVector month, IntegerVector year) {
+    const R_xlen_t n = recycled_length(recycled_length(nth.size(), weekday.size()),
+                                       recycled_length(month.size(), year.size()));
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        const int k = nth[i % nth.size()], wd = weekday[i % weekday.size()];
+        const int m = month[i % month.size()], y = year[i % year.size()];
+        if (k == NA_INTEGER || k < 1 || k > 5 || wd == NA_INTEGER || wd < 0 || wd > 6 ||
+            m == NA_INTEGER || m < 1 || m > 12 || !is_year(y)) {
+            out[i] = NA_REAL;
+        } else {
+            out[i] = cal::nth_weekday(k, wd, m, y);
+        }
+    }
+    return as_dates(out);
+}
+
+// [[Rcpp::export]]
+NumericVector getIMMDates(IntegerVector month, IntegerVector year) {
+    return nthWeekdayOfMonth(IntegerVector::create(3), IntegerVector::create(3),
+                             month, year);
+}
+
+// [[Rcpp::export]]
+NumericVector nextIMMDates(NumericVector date) {
+    const R_xlen_t n = date.size();
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        if (!is_day(date[i])) {
+            out[i] = NA_REAL;
+            continue;
+        }
+        const int z = static_cast<int>(std::floor(date[i]));
+        const cal::Civil c = cal::civil_from_days(z);
+        int m = (c.month + 2) / 3 * 3, y = c.year;      // last month of the quarter
+        int imm = cal::nth_weekday(3, 3, m, y);
+        if (imm <= z) {
+            m += 3;
+            if (m > 12) { m -= 12; y++; }
+            imm = cal::nth_weekday(3, 3, m, y);
+        }
+        out[i] = imm;
+    }
+    return as_dates(out);
+}
+
+/**
+ * `firstDayOfWeekAfter()` is the vectorised form of
+ * `getFirstDayOfWeekAfter()`, and `monthEnd()` gives the last day of the
+ * month of each date.
+ */
+
+// [[Rcpp::export]]
+NumericVector firstDayOfWeekAfter(IntegerVector weekday, NumericVector date) {
+    const R_xlen_t n = recycled_length(weekday.size(), date.size());
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        const int wd = weekday[i % weekday.size()];
+        const double d = date[i % date.size()];
+        if (wd == NA_INTEGER || wd < 0 || wd > 6 || !is_day(d)) {
+            out[i] = NA_REAL;
+        } else {
+            out[i] = cal::first_weekday_after(wd, static_cast<int>(std::floor(d)));
+        }
+    }
+    return as_dates(out);
+}
+
+// [[Rcpp::export]]
+NumericVector monthEnd(NumericVector date) {
+    const R_xlen_t n = date.size();
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        out[i] = is_day(date[i]) ?
+            cal::month_end(static_cast<int>(std::floor(date[i]))) : NA_REAL;
+    }
+    return as_dates(out);
+}
+
+/**
+ * ### Business Days
+ *
+ * A business day is a weekday which is not a holiday. Holidays are given
+ * as a `Date` vector; rather than searching it for every date, a
+ * `Calendar` marks them in a bit vector which spans the days from the first
+ * holiday to the last, so that checking a date is one comparison and one
+ * lookup. For counting business days between two dates it also keeps the
+ * holidays which fall on weekdays in a sorted vector, so the holidays in a
+ * range are counted with two binary searches, and the weekdays in a range
+ * need only arithmetic: five per whole week, plus at most six days checked
+ * one by one.
+ */
+
+class Calendar {
+public:
+    explicit Calendar(const NumericVector& holidays) : lo(0) {
+        for (R_xlen_t i = 0; i < holidays.size(); i++) {
+            if (!is_day(holidays[i])) continue;
+            const int z = static_cast<int>(std::floor(holidays[i]));
+            const int wd = cal::weekday(z);
+            if (wd != 0 && wd != 6) weekday_holidays.push_back(z);
+        }
+        std::sort(weekday_holidays.begin(), weekday_holidays.end());
+        weekday_holidays.erase(std::unique(weekday_holidays.begin(), weekday_holidays.end()),
+                               weekday_holidays.end());
+        if (!weekday_holidays.empty()) {
+            lo = weekday_holidays.front();
+            marked.assign(weekday_holidays.back() - lo + 1, false);
+            for (std::size_t k = 0; k < weekday_holidays.size(); k++)
+                marked[weekday_holidays[k] - lo] = true;
+        }
+    }
+
+    bool is_holiday(int z) const {
+        return z >= lo && z - lo < static_cast<int>(marked.size()) && marked[z - lo];
+    }
+
+    bool is_business_day(int z) const {
+        const int wd = cal::weekday(z);
+        return wd != 0 && wd != 6 && !is_holiday(z);
+    }
+
+    // business days in [from, to)
+    int business_days(int from, int to) const {
+        if (to < from) return -business_days(to, from);
+        const int weeks = (to - from) / 7;
+        int count = 5 * weeks;
+        for (int z = from + 7 * weeks; z < to; z++) {
+            const int wd = cal::weekday(z);
+            count += wd != 0 && wd != 6;
+        }
+        count -= std::lower_bound(weekday_holidays.begin(), weekday_holidays.end(), to) -
+            std::lower_bound(weekday_holidays.begin(), weekday_holidays.end(), from);
+        return count;
+    }
+
+private:
+    std::vector<int> weekday_holidays;
+    std::vector<bool> marked;
+    int lo;
+};
+
+/**
+ * A date which is not a business day is rolled to one by the usual
+ * conventions: *following* moves forward to the next business day,
+ * *preceding* backward to the previous one, and the *modified* forms do the
+ * same unless that crosses into another month, in which case they go the
+ * other way instead. With `"unadjusted"` dates are left alone. Only the
+ * short loops over the days to skip remain; they end after a weekend and a
+ * few holidays at most.
+ */
+
+enum Roll { UNADJUSTED, FOLLOWING, PRECEDING, MODIFIED_FOLLOWING, MODIFIED_PRECEDING };
+
+Roll as_roll(const std::string& convention) {
+    if (convention == "unadjusted") return UNADJUSTED;
+    if (convention == "following") return FOLLOWING;
+    if (convention == "preceding") return PRECEDING;
+    if (convention == "modified following") return MODIFIED_FOLLOWING;
+    if (convention == "modified preceding") return MODIFIED_PRECEDING;
+    stop("Unknown convention '%s'", convention);
+    return UNADJUSTED;  // not reached
+}
+
+inline int roll(int z, Roll convention, const Calendar& calendar) {
+    if (convention == UNADJUSTED) return z;
+    const int step = convention == FOLLOWING || convention == MODIFIED_FOLLOWING ? 1 : -1;
+    int d = z;
+    while (!calendar.is_business_day(d)) d += step;
+    if ((convention == MODIFIED_FOLLOWING || convention == MODIFIED_PRECEDING) &&
+        cal::civil_from_days(d).month != cal::civil_from_days(z).month) {
+        d = z;
+        while (!calendar.is_business_day(d)) d -= step;
+    }
+    return d;
+}
+
+// [[Rcpp::export]]
+NumericVector rollBusinessDays(NumericVector date,
+                               std::string convention = "modified following",
+                               NumericVector holidays = NumericVector(0)) {
+    const Roll how = as_roll(convention);
+    const Calendar calendar(holidays);
+    const R_xlen_t n = date.size();
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        out[i] = is_day(date[i]) ?
+            roll(static_cast<int>(std::floor(date[i])), how, calendar) : NA_REAL;
+    }
+    return as_dates(out);
+}
+
+// [[Rcpp::export]]
+IntegerVector businessDaysBetween(NumericVector from, NumericVector to,
+                                  NumericVector holidays = NumericVector(0)) {
+    const Calendar calendar(holidays);
+    const R_xlen_t n = recycled_length(from.size(), to.size());
+    IntegerVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        const double a = from[i % from.size()], b = to[i % to.size()];
+        out[i] = is_day(a) && is_day(b) ?
+            calendar.business_days(static_cast<int>(std::floor(a)),
+                                   static_cast<int>(std::floor(b))) : NA_INTEGER;
+    }
+    return out;
+}
+
+/**
+ * ### Day Counts
+ *
+ * Interest accrues over a *year fraction* between two dates, and the
+ * markets have a number of conventions for computing it:
+ *
+ * - `"act/360"` and `"act/365"`: actual days divided by 360 or 365.
+ * - `"30/360"`: the US bond basis, which counts every month as 30 days. A
+ *   start on the 31st counts as the 30th, and so does an end on the 31st if
+ *   the start is on the 30th or 31st.
+ * - `"30e/360"`: the Eurobond basis, where the 31st always counts as the
+ *   30th.
+ * - `"act/act"`: the ISDA rule, in which the days in each calendar year are
+ *   divided by the length of that year.
+ * - `"bus/252"`: business days divided by 252, common in Brazil, which
+ *   uses the holidays of the calendar.
+ *
+ * All of these need only the year, month and day fields, or the business
+ * day count from above.
+ */
+
+enum DayCount { ACT_360, ACT_365, THIRTY_360, THIRTY_E_360, ACT_ACT, BUS_252 };
+
+DayCount as_day_count(const std::string& convention) {
+    if (convention == "act/360") return ACT_360;
+    if (convention == "act/365") return ACT_365;
+    if (convention == "30/360") return THIRTY_360;
+    if (convention == "30e/360") return THIRTY_E_360;
+    if (convention == "act/act") return ACT_ACT;
+    if (convention == "bus/252") return BUS_252;
+    stop("Unknown day count convention '%s'", convention);
+    return ACT_360;  // not reached
+}
+
+inline double thirty_360(const cal::Civil& a, const cal::Civil& b, bool european) {
+    int d1 = a.day, d2 = b.day;
+    if (d1 == 31) d1 = 30;
+    if (d2 == 31 && (european || d1 == 30)) d2 = 30;
+    return (360.0 * (b.year - a.year) + 30.0 * (b.month - a.month) + (d2 - d1)) / 360.0;
+}
+
+inline double act_act(int from, int to) {
+    if (to < from) return -act_act(to, from);
+    const int y1 = cal::civil_from_days(from).year, y2 = cal::civil_from_days(to).year;
+    const double b1 = cal::is_leap(y1) ? 366.0 : 365.0, b2 = cal::is_leap(y2) ? 366.0 : 365.0;
+    if (y1 == y2) return (to - from) / b1;
+    return (cal::days_from_civil(y1 + 1, 1, 1) - from) / b1 + (y2 - y1 - 1) +
+        (to - cal::days_from_civil(y2, 1, 1)) / b2;
+}
+
+inline double year_fraction(int from, int to, DayCount convention, const Calendar& calendar) {
+    switch (convention) {
+    case ACT_360: return (to - from) / 360.0;
+    case ACT_365: return (to - from) / 365.0;
+    case THIRTY_360: return thirty_360(cal::civil_from_days(from), cal::civil_from_days(to), false);
+    case THIRTY_E_360: return thirty_360(cal::civil_from_days(from), cal::civil_from_days(to), true);
+    case ACT_ACT: return act_act(from, to);
+    case BUS_252: return calendar.business_days(from, to) / 252.0;
+    }
+    return NA_REAL;
+}
+
+// [[Rcpp::export]]
+NumericVector yearFraction(NumericVector from, NumericVector to,
+                           std::string convention = "act/360",
+                           NumericVector holidays = NumericVector(0)) {
+    const DayCount how = as_day_count(convention);
+    const Calendar calendar(holidays);
+    const R_xlen_t n = recycled_length(from.size(), to.size());
+    NumericVector out(n);
+    for (R_xlen_t i = 0; i < n; i++) {
+        const double a = from[i % from.size()], b = to[i % to.size()];
+        out[i] = is_day(a) && is_day(b) ?
+            year_fraction(static_cast<int>(std::floor(a)), static_cast<int>(std::floor(b)),
+                          how, calendar) : NA_REAL;
+    }
+    return out;
+}
+
+/**
+ * ## Illustration
+ *
+ * The examples of the two earlier articles give the same dates, but now
+ * for whole vectors at once:
+ */
+
+/*** R
+getIMMDates(c(3, 6), 2013)
+getIMMDates(c(3, 6), 2033)
+firstDayOfWeekAfter(1, as.Date("2020-01-01"))
+*/
+
+/**
+ * As a small schedule, we take the quarterly IMM dates of the next two
+ * years and compute the accrual fractions between them, and the month ends
+ * of 2024 rolled with a few holidays:
+ */
+
+/*** R
+imm <- getIMMDates(rep(c(3, 6, 9, 12), 2), rep(2027:2028, each=4))
+imm
+yearFraction(head(imm, -1), tail(imm, -1), "act/360")
+yearFraction(head(imm, -1), tail(imm, -1), "30/360")
+
+holidays <- as.Date(c("2024-03-29", "2024-12-25", "2024-12-26"))
+ends <- monthEnd(as.Date(sprintf("2024-%02d-01", 1:12)))
+data.frame(end = ends,
+           following = rollBusinessDays(ends, "following", holidays),
+           modified = rollBusinessDays(ends, "modified following", holidays))
+businessDaysBetween(as.Date("2024-01-01"), as.Date("2025-01-01"), holidays)
+*/
+
+/**
+ * ### Checks and Timing
+ *
+ * We check the kernels against R's own date arithmetic on a few thousand
+ * years of days, and compare the IMM dates with a plain R version which
+ * uses `seq()` and `weekdays()` for a million months:
+ */
+
+/*** R
+d <- as.Date(-400000:400000)
+lt <- as.POSIXlt(d)
+e <- monthEnd(d)
+stopifnot(format(e, "%Y-%m") == format(d, "%Y-%m"),
+          format(e + 1, "%d") == "01",
+          as.POSIXlt(firstDayOfWeekAfter(lt$wday, d))$wday == lt$wday,
+          firstDayOfWeekAfter(lt$wday, d) - d == 7)
+
+months <- sample(1:12, 1e6, replace=TRUE)
+years <- sample(1990:2050, 1e6, replace=TRUE)
+immR <- function(m, y) {
+    first <- as.Date(sprintf("%d-%02d-01", y, m))
+    first + (3 - as.POSIXlt(first)$wday) %% 7 + 14
+}
+stopifnot(identical(as.integer(getIMMDates(months, years)), as.integer(immR(months, years))))
+
+library(rbenchmark)
+benchmark(kernel = getIMMDates(months, years),
+          R = immR(months, years),
+          order = "relative", replications = 3)[,1:4]
+*/
@@ -0,0 +1,473 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Zero-Copy Boost.Geometry Views of R Matrices
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags boost parallel
+ * @summary Adapts the two columns of a NumericMatrix as Boost.Geometry rings
+ *   and multi-points without copying them, and uses the adapters to compute
+ *   convex hulls, areas, centroids and simplifications for many groups of
+ *   points in parallel.
+ *
+ * The article on [custom as and wrap converters for
+ * Boost.Geometry](https://gallery.rcpp.org/articles/boost-geometry-as-and-wrap-example)
+ * converts an `n x 2` matrix into a Boost.Geometry polygon by copying
+ * every row into a vector of `boost::tuple` points, computes the convex hull
+ * of that polygon, and converts the hull back. That is fine for one
+ * polygon. But with, say, the GPS fixes of ten thousand vehicles in one
+ * long matrix and a vehicle id for each row, we would need to split the
+ * matrix in R, call the function once per vehicle and copy each piece
+ * twice on the way.
+ *
+ * Boost.Geometry does not actually need its own types: its algorithms work
+ * on anything that is registered with its traits. Here we register light
+ * *views* of some rows of a matrix, which read the coordinates from the two
+ * columns where R keeps them, and use them to process every group in one
+ * call, in parallel.
+ */
+
+// [[Rcpp::depends(BH, RcppParallel)]]
+// [[Rcpp::plugins(cpp14)]]
+#include <Rcpp.h>
+#include <RcppParallel.h>
+#include <boost/geometry.hpp>
+#include <boost/geometry/geometries/point.hpp>
+#include <boost/geometry/geometries/ring.hpp>
+#include <boost/geometry/geometries/linestring.hpp>
+#include <boost/geometry/geometries/polygon.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+
+#include <cmath>
+#include <vector>
+
+using namespace Rcpp;
+using namespace RcppParallel;
+
+namespace bg = boost::geometry;
+typedef bg::model::point<double, 2, bg::cs::cartesian> point_t;
+typedef bg::model::ring<point_t> ring_t;
+typedef bg::model::linestring<point_t> linestring_t;
+
+/**
+ * ### The Views
+ *
+ * An R matrix stores its `x` column and then its `y` column, so the two
+ * coordinates of a point are `nrow` doubles apart. A view is described by
+ * the two column pointers and the rows it covers: either the first `n`
+ * rows, or the rows listed in `index`, which lets a view cover a group of
+ * rows that are scattered through the matrix.
+ *
+ * Its iterator assembles each point as it is dereferenced. As there is no
+ * `point_t` object in memory to refer to, it returns the point by value,
+ * which is cheap for two doubles, and is the one difference from
+ * iterating over a `std::vector<point_t>`.
+ */
+
+struct Rows {
+    const double* x;
+    const double* y;
+    const int* index;       // rows of the view, or NULL for 0, ..., n - 1
+    std::ptrdiff_t n;
+};
+
+class RowIterator
+    : public boost::iterator_facade<RowIterator, point_t,
+                                    boost::random_access_traversal_tag, point_t> {
+public:
+    RowIterator() : rows(), k(0) {}
+    RowIterator(const Rows& rows, std::ptrdiff_t k) : rows(rows), k(k) {}
+
+private:
+    friend class boost::iterator_core_access;
+
+    // position n wraps around to the first point, see RingView below
+    point_t dereference() const {
+        const std::ptrdiff_t i = k == rows.n ? 0 : k;
+        const std::ptrdiff_t r = rows.index ? rows.index[i] : i;
+        return point_t(rows.x[r], rows.y[r]);
+    }
+    bool equal(const RowIterator& other) const { return k == other.k; }
+    void increment() { ++k; }
+    void decrement() { --k; }
+    void advance(std::ptrdiff_t d) { k += d; }
+    std::ptrdiff_t distance_to(const RowIterator& other) const { return other.k - k; }
+
+    Rows rows;
+    std::ptrdiff_t k;
+};
+
+/**
+ * Boost.Geometry handles rings which are not closed, that is whose last
+ * point does not repeat the first, by wrapping them in an iterator which
+ * appends the first point at the end. That wrapper hands out references to
+ * the points of the range, which our iterator cannot support. So the ring
+ * view closes itself instead: it is one point longer than the group, and
+ * its last position reads the first row again. Point data from R rarely
+ * repeats the first point, so this is what we want anyway.
+ *
+ * The multi-point view is the same rows without the extra point.
+ */
+
+struct RingView {
+    typedef RowIterator iterator;
+    typedef RowIterator const_iterator;
+    Rows rows;
+
+    RowIterator begin() const { return RowIterator(rows, 0); }
+    RowIterator end() const { return RowIterator(rows, rows.n + (rows.n > 0)); }
+};
+
+struct MultiPointView {
+    typedef RowIterator iterator;
+    typedef RowIterator const_iterator;
+    Rows rows;
+
+    RowIterator begin() const { return RowIterator(rows, 0); }
+    RowIterator end() const { return RowIterator(rows, rows.n); }
+};
+
+/**
+ * Registering the views takes one trait for the kind of geometry and, for
+ * the ring, its orientation and closure. Boost.Range finds `begin()` and
+ * `end()` by itself.
+ */
+
+namespace boost { namespace geometry { namespace traits {
+    template <> struct tag<RingView> { typedef ring_tag type; };
+    template <> struct point_order<RingView> { static const order_selector value = clockwise; };
+    template <> struct closure<RingView> { static const closure_selector value = closed; };
+    template <> struct tag<MultiPointView> { typedef multi_point_tag type; };
+}}}
+
+/**
+ * A word of caution: the by-value iterator works with algorithms which
+ * copy the points they need, such as `area()`, `convex_hull()` or the
+ * centroid of a multi-point, but not with those which keep a reference to
+ * an input point. The centroid of a ring is one of them, so we compute it
+ * with the usual shoelace sums (which is what Boost does too); for a
+ * degenerate ring of zero area, we fall back to the mean of the points.
+ * The sums are centred on the first point for accuracy, and come out
+ * right for rings of either orientation.
+ */
+
+point_t ring_centroid(const RingView& ring) {
+    RowIterator it = ring.begin();
+    const point_t origin = *it;
+    double a = 0.0, cx = 0.0, cy = 0.0;
+    point_t p = origin;
+    for (++it; it != ring.end(); ++it) {
+        const point_t q = *it;
+        const double x0 = bg::get<0>(p) - bg::get<0>(origin), y0 = bg::get<1>(p) - bg::get<1>(origin);
+        const double x1 = bg::get<0>(q) - bg::get<0>(origin), y1 = bg::get<1>(q) - bg::get<1>(origin);
+        const double cross = x0 * y1 - x1 * y0;
+        a += cross;
+        cx += (x0 + x1) * cross;
+        cy += (y0 + y1) * cross;
+        p = q;
+    }
+    point_t c;
+    if (a != 0.0) {
+        c = point_t(bg::get<0>(origin) + cx / (3 * a), bg::get<1>(origin) + cy / (3 * a));
+    } else {
+        MultiPointView points = { ring.rows };
+        bg::centroid(points, c);
+    }
+    return c;
+}
+
+/**
+ * ### One Matrix
+ *
+ * With the views, the convex hull function of the converter article reads
+ * its input in place; only the hull itself is built as a Boost.Geometry
+ * ring, and copied into the result.
+ */
+
+NumericMatrix ring_to_matrix(const ring_t& ring) {
+    NumericMatrix res(ring.size(), 2);
+    for (std::size_t i = 0; i < ring.size(); ++i) {
+        res(i, 0) = bg::get<0>(ring[i]);
+        res(i, 1) = bg::get<1>(ring[i]);
+    }
+    return res;
+}
+
+// [[Rcpp::export]]
+NumericMatrix convexHullView(NumericMatrix points) {
+    if (points.ncol() != 2) stop("points must be a matrix with 2 columns");
+    const MultiPointView view = { { &points(0, 0), &points(0, 1), NULL, points.nrow() } };
+    ring_t hull;
+    bg::convex_hull(view, hull);
+    return ring_to_matrix(hull);
+}
+
+/**
+ * ### Groups
+ *
+ * For the grouped functions, the rows of each group are listed together by
+ * a counting sort on the group ids, which are integers from `1` to the
+ * number of groups, as the codes of a factor are. Rows whose group is `NA`
+ * are left out, and the coordinates of the others must not be missing.
+ * Within a group the rows keep their order, which matters for rings and
+ * paths. The index takes four bytes per row, a quarter of a copy of the
+ * coordinates.
+ */
+
+struct Groups {
+    std::vector<int> index, start;
+
+    Groups(const NumericMatrix& points, const IntegerVector& group) {
+        if (points.ncol() != 2) stop("points must be a matrix with 2 columns");
+        if (group.size() != points.nrow()) stop("group must have one entry per row of points");
+        int ngroups = 0;
+        for (R_xlen_t i = 0; i < group.size(); ++i) {
+            if (group[i] == NA_INTEGER) continue;
+            if (group[i] < 1) stop("group ids must be positive");
+            if (ISNAN(points(i, 0)) || ISNAN(points(i, 1))) stop("coordinates must not be missing");
+            if (group[i] > ngroups) ngroups = group[i];
+        }
+        start.assign(ngroups + 1, 0);
+        for (R_xlen_t i = 0; i < group.size(); ++i)
+            if (group[i] != NA_INTEGER) start[group[i]]++;
+        for (int g = 0; g < ngroups; ++g) start[g + 1] += start[g];
+        index.resize(start[ngroups]);
+        std::vector<int> pos(start.begin(), start.end() - 1);
+        for (R_xlen_t i = 0; i < group.size(); ++i)
+            if (group[i] != NA_INTEGER) index[pos[group[i] - 1]++] = i;
+    }
+
+    std::size_t size() const { return start.size() - 1; }
+
+    Rows rows(const NumericMatrix& points, std::size_t g) const {
+        const Rows r = { &points(0, 0), &points(0, 1), index.data() + start[g],
+                         start[g + 1] - start[g] };
+        return r;
+    }
+};
+
+/**
+ * ### Summaries
+ *
+ * The first grouped function takes each group as a polygon, with its rows
+ * as the vertices in order, and reports its area and centroid, together
+ * with the area of its convex hull. Groups with fewer than three points
+ * get `NA`. As usual with RcppParallel, the worker writes into
+ * preallocated `RVector`s; the views need nothing else from R.
+ */
+
+struct Summaries : public Worker {
+    const Groups& groups;
+    const NumericMatrix& points;
+    RVector<double> area, cx, cy, hull_area;
+
+    Summaries(const Groups& groups, const NumericMatrix& points, NumericVector area,
+              NumericVector cx, NumericVector cy, NumericVector hull_area)
+        : groups(groups), points(points), area(area), cx(cx), cy(cy), hull_area(hull_area) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        ring_t hull;
+        for (std::size_t g = begin; g < end; ++g) {
+            const Rows rows = groups.rows(points, g);
+            if (rows.n < 3) {
+                area[g] = cx[g] = cy[g] = hull_area[g] = NA_REAL;
+                continue;
+            }
+            const RingView ring = { rows };
+            const MultiPointView cloud = { rows };
+            area[g] = std::fabs(bg::area(ring));
+            const point_t c = ring_centroid(ring);
+            cx[g] = bg::get<0>(c);
+            cy[g] = bg::get<1>(c);
+            hull.clear();
+            bg::convex_hull(cloud, hull);
+            hull_area[g] = bg::area(hull);
+        }
+    }
+};
+
+// [[Rcpp::export]]
+DataFrame group_summaries(NumericMatrix points, IntegerVector group) {
+    const Groups groups(points, group);
+    const std::size_t n = groups.size();
+    NumericVector area(n), cx(n), cy(n), hull_area(n);
+    Summaries summaries(groups, points, area, cx, cy, hull_area);
+    parallelFor(0, n, summaries, 16);
+    return DataFrame::create(_["group"] = seq_len(n), _["area"] = area,
+                             _["centroid_x"] = cx, _["centroid_y"] = cy,
+                             _["hull_area"] = hull_area);
+}
+
+/**
+ * ### Hulls and Simplified Paths
+ *
+ * The other two grouped functions return geometries: the convex hull of
+ * each group, and each group's path simplified with the Douglas-Peucker
+ * algorithm. Their sizes are only known once they are computed, so the
+ * workers store one geometry per group, and the results are then bound
+ * into a single data frame with a `group` column, in the usual long format
+ * for plotting.
+ *
+ * `simplify()` requires its input and output to be of the same type, so
+ * there we copy each path into a `linestring`; the output has to be built
+ * anyway, and the copy lives only as long as the group is being processed.
+ */
+
+template <class Geometry>
+DataFrame bind_groups(const std::vector<Geometry>& geoms) {
+    std::size_t total = 0;
+    for (std::size_t g = 0; g < geoms.size(); ++g) total += geoms[g].size();
+    IntegerVector group(total);
+    NumericVector x(total), y(total);
+    std::size_t k = 0;
+    for (std::size_t g = 0; g < geoms.size(); ++g)
+        for (std::size_t i = 0; i < geoms[g].size(); ++i, ++k) {
+            group[k] = g + 1;
+            x[k] = bg::get<0>(geoms[g][i]);
+            y[k] = bg::get<1>(geoms[g][i]);
+        }
+    return DataFrame::create(_["group"] = group, _["x"] = x, _["y"] = y);
+}
+
+struct Hulls : public Worker {
+    const Groups& groups;
+    const NumericMatrix& points;
+    std::vector<ring_t>& hulls;
+
+    Hulls(const Groups& groups, const NumericMatrix& points, std::vector<ring_t>& hulls)
+        : groups(groups), points(points), hulls(hulls) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t g = begin; g < end; ++g) {
+            const MultiPointView cloud = { groups.rows(points, g) };
+            if (cloud.rows.n > 0) bg::convex_hull(cloud, hulls[g]);
+        }
+    }
+};
+
+// [[Rcpp::export]]
+DataFrame group_hulls(NumericMatrix points, IntegerVector group) {
+    const Groups groups(points, group);
+    std::vector<ring_t> hulls(groups.size());
+    Hulls worker(groups, points, hulls);
+    parallelFor(0, groups.size(), worker, 16);
+    return bind_groups(hulls);
+}
+
+struct Simplify : public Worker {
+    const Groups& groups;
+    const NumericMatrix& points;
+    const double tolerance;
+    std::vector<linestring_t>& paths;
+
+    Simplify(const Groups& groups, const NumericMatrix& points, double tolerance,
+             std::vector<linestring_t>& paths)
+        : groups(groups), points(points), tolerance(tolerance), paths(paths) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t g = begin; g < end; ++g) {
+            const MultiPointView rows = { groups.rows(points, g) };
+            const linestring_t path(rows.begin(), rows.end());
+            bg::simplify(path, paths[g], tolerance);
+        }
+    }
+};
+
+// [[Rcpp::export]]
+DataFrame group_simplify(NumericMatrix points, IntegerVector group, double tolerance) {
+    if (!(tolerance >= 0)) stop("tolerance must be non-negative");
+    const Groups groups(points, group);
+    std::vector<linestring_t> paths(groups.size());
+    Simplify worker(groups, points, tolerance, paths);
+    parallelFor(0, groups.size(), worker, 16);
+    return bind_groups(paths);
+}
+
+/**
+ * The workers hold the `NumericMatrix` only by reference and read it
+ * through the raw column pointers of the views, so no R API is called from
+ * the worker threads.
+ *
+ * ### Examples
+ *
+ * The example of the converter article gives the same hull as before:
+ */
+
+/*** R
+points <- c(2.0, 1.3, 2.4, 1.7, 2.8, 1.8, 3.4, 1.2, 3.7, 1.6, 3.4, 2.0, 4.1, 3.0, 5.3, 2.6, 5.4, 1.2, 4.9, 0.8, 2.9, 0.7, 2.0, 1.3)
+points.matrix <- matrix(points, ncol=2, byrow=TRUE)
+convexHullView(points.matrix)
+*/
+
+/**
+ * For grouped data, we simulate the tracks of ten thousand vehicles as
+ * random walks of 50 to 500 steps each, with the rows of all the tracks
+ * shuffled together. A unit square traversed in both directions checks
+ * areas and centroids.
+ */
+
+/*** R
+set.seed(42)
+ngroups <- 1e4
+len <- sample(50:500, ngroups, replace=TRUE)
+id <- rep(seq_len(ngroups), len)
+xy <- cbind(ave(rnorm(length(id)), id, FUN=cumsum) + 100 * runif(ngroups)[id],
+            ave(rnorm(length(id)), id, FUN=cumsum) + 100 * runif(ngroups)[id])
+shuffle <- sample(length(id))
+xy <- xy[shuffle, ]; id <- id[shuffle]
+dim(xy)
+
+sq <- rbind(c(0, 0), c(1, 0), c(1, 1), c(0, 1))
+group_summaries(rbind(sq, sq[4:1, ]), rep(1:2, each=4))
+
+s <- group_summaries(xy, id)
+head(s)
+h <- group_hulls(xy, id)
+head(h)
+p <- group_simplify(xy, id, tolerance=2)
+c(points=nrow(xy), simplified=nrow(p))
+*/
+
+/**
+ * Base R's `chull()` finds the same hulls (whose rings repeat their first
+ * vertex, hence the one extra row per group):
+ */
+
+/*** R
+byid <- split(as.data.frame(xy), id)
+stopifnot(identical(as.vector(table(h$group)),
+                    sapply(byid, function(d) length(chull(d)) + 1L, USE.NAMES=FALSE)))
+*/
+
+/**
+ * ### Timing
+ *
+ * We compare the grouped hulls with splitting the matrix in R and calling
+ * a hull function which copies its input into a polygon, as the original
+ * article does, once per group.
+ */
+
+// [[Rcpp::export]]
+NumericMatrix convexHullCopy(NumericMatrix pointsMatrix) {
+    bg::model::polygon<point_t> poly;
+    for (int i = 0; i < pointsMatrix.nrow(); ++i)
+        poly.outer().push_back(point_t(pointsMatrix(i, 0), pointsMatrix(i, 1)));
+    ring_t hull;
+    bg::convex_hull(poly, hull);
+    return ring_to_matrix(hull);
+}
+
+/*** R
+library(rbenchmark)
+benchmark(grouped = group_hulls(xy, id),
+          split = lapply(split(seq_len(nrow(xy)), id),
+                         function(r) convexHullCopy(xy[r, , drop=FALSE])),
+          order = "relative", replications = 3)[,1:4]
+*/
+
+/**
+ * The grouped version saves the copies, the per-group calls from R, and
+ * spreads the groups over all cores; all three matter when the groups are
+ * small, which is the common case for tracks or areas. The same views
+ * would serve any other Boost.Geometry algorithm which copies its input
+ * points, such as `envelope()`, `length()` or `perimeter()`.
+ */
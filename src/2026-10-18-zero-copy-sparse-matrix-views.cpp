@@ -0,0 +1,248 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+/**
+ * @title Zero-Copy Views of dgCMatrix Objects in Armadillo and Eigen
+ * @author Rcpp Gallery contributors
+ * @license GPL (>= 2)
+ * @tags armadillo eigen matrix sparse
+ * @summary Shows how a dgCMatrix from the Matrix package can be used as an
+ *   Armadillo or Eigen sparse matrix without copying its index and value
+ *   arrays.
+ *
+ * The articles on [as and wrap for sparse
+ * matrices](https://gallery.rcpp.org/articles/as-and-wrap-for-sparse-matrices)
+ * and on [sparse matrices in
+ * Armadillo](https://gallery.rcpp.org/articles/armadillo-sparse-matrix)
+ * convert a `dgCMatrix` into an `arma::sp_mat` by allocating new storage and
+ * copying the `i`, `p` and `x` slots into it, and the corresponding `wrap()`
+ * copies everything back into fresh R vectors. That is two full passes over
+ * memory, plus the allocations, for every call. For a matrix with a billion
+ * non-zero elements this is twelve gigabytes of traffic each way, which is
+ * typically far more than the computation that the matrix was passed down
+ * for.
+ *
+ * A `dgCMatrix` already *is* a compressed sparse column (CSC) matrix: `p`
+ * holds the column pointers, `i` the zero-based row indices and `x` the
+ * values. Armadillo and Eigen use the same layout internally, so if we are
+ * only going to read the matrix, we can point them at R's memory instead.
+ */
+
+// [[Rcpp::depends(RcppArmadillo, RcppEigen)]]
+// [[Rcpp::plugins(cpp11)]]
+#include <RcppArmadillo.h>
+#include <RcppEigen.h>
+
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+using namespace Rcpp;
+
+/**
+ * ### Armadillo
+ *
+ * Armadillo has no public interface for sparse matrices over external
+ * memory, so the view below takes the same route as the older
+ * `convertSparse2` example and sets the internal pointers of an `sp_mat`
+ * through `arma::access::rw()`. Three details need care:
+ *
+ * - Armadillo's index type `arma::uword` is a 32-bit unsigned integer in the
+ *   default RcppArmadillo configuration, and thus has the same size as R's
+ *   `int`. Row indices are never negative, so the `i` slot can be used as it
+ *   is. If `ARMA_64BIT_WORD` is defined, the sizes differ and the row indices
+ *   have to be converted; the view does that automatically.
+ * - Armadillo's sparse iterators expect one extra column pointer holding a
+ *   sentinel value. R's `p` slot has no room for it, so the `ncol + 2`
+ *   column pointers are copied. That is O(ncol) rather than O(nnz), which is
+ *   negligible for all but the most extremely short and wide matrices.
+ * - The `sp_mat` must never free R's memory. The view swaps its own pointers
+ *   in when it is created, and swaps Armadillo's original pointers back in
+ *   its destructor, so that Armadillo only ever releases what it allocated.
+ *
+ * The view is read-only: anything that would modify the matrix, and hence
+ * reallocate its storage, must operate on a copy.
+ */
+
+class ArmaSpView {
+public:
+    explicit ArmaSpView(S4 mat)
+        : i(mat.slot("i")), p(mat.slot("p")), x(mat.slot("x")) {
+        if (!mat.is("dgCMatrix")) stop("expected a dgCMatrix");
+        IntegerVector dims = mat.slot("Dim");
+        const arma::uword nrow = dims[0], ncol = dims[1], nnz = x.size();
+        if ((double) nrow * ncol > (double) std::numeric_limits<arma::uword>::max())
+            stop("matrix too large for this arma::uword; define ARMA_64BIT_WORD");
+
+        colptr.assign(p.begin(), p.end());
+        colptr.push_back(std::numeric_limits<arma::uword>::max());
+
+        const arma::uword* rowind;
+        if (sizeof(arma::uword) == sizeof(int)) {
+            rowind = reinterpret_cast<const arma::uword*>(i.begin());
+        } else {
+            rowidx.assign(i.begin(), i.end());
+            rowind = rowidx.data();
+        }
+
+        // keep Armadillo's own (empty) storage so that it can be released
+        saved_values = m.values;
+        saved_rows = m.row_indices;
+        saved_cols = m.col_ptrs;
+
+        arma::access::rw(m.n_rows) = nrow;
+        arma::access::rw(m.n_cols) = ncol;
+        arma::access::rw(m.n_elem) = nrow * ncol;
+        arma::access::rw(m.n_nonzero) = nnz;
+        arma::access::rw(m.values) = x.begin();
+        arma::access::rw(m.row_indices) = rowind;
+        arma::access::rw(m.col_ptrs) = colptr.data();
+    }
+
+    ~ArmaSpView() {
+        arma::access::rw(m.values) = saved_values;
+        arma::access::rw(m.row_indices) = saved_rows;
+        arma::access::rw(m.col_ptrs) = saved_cols;
+        arma::access::rw(m.n_rows) = 0;
+        arma::access::rw(m.n_cols) = 0;
+        arma::access::rw(m.n_elem) = 0;
+        arma::access::rw(m.n_nonzero) = 0;
+    }
+
+    const arma::sp_mat& get() const { return m; }
+
+private:
+    ArmaSpView(const ArmaSpView&);            // not copyable
+    ArmaSpView& operator=(const ArmaSpView&);
+
+    IntegerVector i, p;
+    NumericVector x;
+    std::vector<arma::uword> colptr, rowidx;
+    arma::sp_mat m;
+    const double* saved_values;
+    const arma::uword* saved_rows;
+    const arma::uword* saved_cols;
+};
+
+/**
+ * ### Eigen
+ *
+ * Eigen is easier: `Eigen::Map<Eigen::SparseMatrix<double> >` (the
+ * successor of `Eigen::MappedSparseMatrix`, which RcppEigen also supports
+ * through `as<>()`) wraps external CSC arrays directly, and its default index
+ * type is a signed `int`, exactly like R's. The only thing the view has to
+ * do is to hold on to the slot vectors so that their memory stays protected
+ * for as long as the map is in use.
+ */
+
+typedef Eigen::SparseMatrix<double> SpMat;
+typedef Eigen::Map<SpMat> MapSpMat;
+
+class EigenSpView {
+public:
+    explicit EigenSpView(S4 mat)
+        : i(mat.slot("i")), p(mat.slot("p")), x(mat.slot("x")),
+          dims(mat.slot("Dim")),
+          m(dims[0], dims[1], x.size(), p.begin(), i.begin(), x.begin()) {
+        if (!mat.is("dgCMatrix")) stop("expected a dgCMatrix");
+    }
+
+    const MapSpMat& get() const { return m; }
+
+private:
+    IntegerVector i, p;
+    NumericVector x;
+    IntegerVector dims;
+    MapSpMat m;
+};
+
+/**
+ * ### Using the Views
+ *
+ * With the views in place, the sparse matrix can be passed on to any
+ * Armadillo or Eigen operation that takes a constant sparse matrix. Here are
+ * matrix-vector products in both libraries, next to the copying version
+ * which relies on RcppArmadillo's built-in `as<arma::sp_mat>()`:
+ */
+
+// [[Rcpp::export]]
+arma::vec spmv_copy(const arma::sp_mat& A, const arma::vec& v) {
+    return A * v;
+}
+
+// [[Rcpp::export]]
+arma::vec spmv_arma_view(S4 A, const arma::vec& v) {
+    ArmaSpView view(A);
+    return view.get() * v;
+}
+
+// [[Rcpp::export]]
+Eigen::VectorXd spmv_eigen_view(S4 A, Eigen::Map<Eigen::VectorXd> v) {
+    EigenSpView view(A);
+    return view.get() * v;
+}
+
+/**
+ * The same idea works in the other direction. Many operations on a sparse
+ * matrix (scaling, transforming the non-zero values) leave its sparsity
+ * pattern unchanged. The result can then share the `i`, `p` and `Dim` slots
+ * of the input, and only the new `x` slot is allocated. Sharing vectors
+ * between R objects is safe, since R copies a shared vector before anything
+ * modifies it.
+ */
+
+// [[Rcpp::export]]
+S4 scale_columns(S4 A, NumericVector s) {
+    EigenSpView view(A);
+    const MapSpMat& m = view.get();
+    if (s.size() != m.cols()) stop("length(s) must equal ncol(A)");
+
+    NumericVector x(m.nonZeros());
+    const double* xin = m.valuePtr();
+    const int* p = m.outerIndexPtr();
+    for (int j = 0; j < m.cols(); j++)
+        for (int k = p[j]; k < p[j + 1]; k++)
+            x[k] = xin[k] * s[j];
+
+    S4 res("dgCMatrix");
+    res.slot("i") = A.slot("i");
+    res.slot("p") = A.slot("p");
+    res.slot("Dim") = A.slot("Dim");
+    res.slot("Dimnames") = A.slot("Dimnames");
+    res.slot("x") = x;
+    return res;
+}
+
+/**
+ * ### Checking and Timing
+ */
+
+/*** R
+suppressMessages({
+  library(methods)
+  library(Matrix)
+})
+set.seed(42)
+A <- rsparsematrix(20000, 5000, density = 0.01)
+v <- rnorm(ncol(A))
+
+stopifnot(all.equal(spmv_arma_view(A, v), spmv_copy(A, v)),
+          all.equal(as.vector(spmv_eigen_view(A, v)), as.vector(A %*% v)),
+          all.equal(scale_columns(A, v), A %*% Diagonal(x = v), check.attributes = FALSE))
+
+# the result shares the index slots of the input
+B <- scale_columns(A, v)
+stopifnot(identical(B@i, A@i), identical(B@p, A@p))
+
+library(rbenchmark)
+benchmark(spmv_copy(A, v),
+          spmv_arma_view(A, v),
+          spmv_eigen_view(A, v),
+          order = "relative", replications = 100)[,1:4]
+*/
+
+/**
+ * The copying version spends most of its time building the `sp_mat`, so the
+ * views are faster by roughly the ratio of copy cost to product cost; a
+ * single product touches every non-zero exactly once, just like the copy.
+ * For matrices near the memory limit the more important benefit is that the
+ * view needs no second copy of the matrix at all.
+ */